@@ -0,0 +1,64 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <format>
+
+#include <FSTree.hpp>
+#include <scheduler.hpp>
+
+// Makespan of the scheduling policies: the time until every checksum of the tree is available, and the time until
+// the first one is. Usage: bench [path] [jobs] [algorithm], without a path a tree with many small files and one big
+// file at the end of the traversal is generated in the temp directory.
+
+static std::filesystem::path makeTree() {
+	auto root = std::filesystem::temp_directory_path() / "hasher_bench";
+	if (std::filesystem::exists(root)) return root;
+
+	std::filesystem::create_directories(root / "small");
+	std::filesystem::create_directories(root / "zbig");
+	std::string block(1 << 16, 'x');
+	for (int i = 0; i < 512; i++) {
+		std::ofstream(root / "small" / std::to_string(i), std::ios::binary) << block;
+	}
+	std::ofstream big(root / "zbig" / "big", std::ios::binary);
+	for (int i = 0; i < 1024; i++)
+		big << block;
+	return root;
+}
+
+int main(int argc, char **argv) {
+	std::filesystem::path path		= argc > 1 ? std::filesystem::path(argv[1]) : makeTree();
+	std::size_t			  jobs		= argc > 2 ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+	std::string			  algorithm = argc > 3 ? argv[3] : "sha256";
+
+	auto tree = FSTreeBuilderNoLinks().build(path);
+	if (!tree) return 1;
+	std::vector<const File *> files;
+	tree->accept(FileCollector(files));
+
+	std::cout << std::format("{} files, {} bytes, {} jobs, {}\n", files.size(), tree->size, jobs, algorithm);
+	std::cout << std::format("{:16} {:>12} {:>12}\n", "policy", "first (ms)", "makespan (ms)");
+
+	auto keys = SchedulingPolicyFactory::instance().getKeys();
+	std::ranges::sort(keys);
+	for (const auto &name : keys) {
+		auto policy = SchedulingPolicyFactory::instance().create(name);
+		auto first	= std::numeric_limits<double>::max();
+
+		auto		  start = std::chrono::steady_clock::now();
+		HashScheduler scheduler(*tree, algorithm, *policy, jobs);
+		auto		  elapsed = [&] {
+			 return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		};
+		// the first file to finish is the first one in hashing order
+		auto order = policy->order(files);
+		if (!order.empty()) {
+			scheduler.take(*files[order[0]]);
+			first = elapsed();
+		}
+		for (std::size_t i = 1; i < order.size(); i++)
+			scheduler.take(*files[order[i]]);
+
+		std::cout << std::format("{:16} {:12.1f} {:12.1f}\n", name, order.empty() ? 0.0 : first, elapsed());
+	}
+}
@@ -1,6 +1,7 @@
 #include <cassert>
 #include <iostream>
 
+#include <tclap/MultiArg.h>
 #include <tclap/SwitchArg.h>
 #include <tclap/ValueArg.h>
 #include <tclap/ValuesConstraint.h>
@@ -11,6 +12,11 @@
 #include <utils.hpp>
 #include <visitors.hpp>
 #include <reportData.hpp>
+#include <treeDiff.hpp>
+#include <daemon.hpp>
+#include <shards.hpp>
+#include <compression.hpp>
+#include <csignal>
 #include "progress.hpp"
 
 int main(int argc, char **argv) {
@@ -18,19 +24,99 @@ int main(int argc, char **argv) {
 	try {
 		std::vector<std::string>			 algorithms = ChecksumCalculatorFactory::instance().getKeys();
 		std::vector<std::string>			 formats	= HashStreamWriterFactory::instance().getKeys();
+		std::vector<std::string>			 policies	= SchedulingPolicyFactory::instance().getKeys();
 		TCLAP::ValuesConstraint<std::string> allowedAlgs(algorithms);
 		TCLAP::ValuesConstraint<std::string> allowedFormats(formats);
+		TCLAP::ValuesConstraint<std::string> allowedPolicies(policies);
 
 		TCLAP::CmdLine cmd("Checksum Calculator", ' ', "0.0.1");
 
-		TCLAP::ValueArg<std::string> pathArg("p", "path", "path to calculate checksums for", false, ".", "string", cmd);
+		TCLAP::MultiArg<std::string> pathArg("p", "path",
+											 "path to calculate checksums for, given twice compares the two paths",
+											 false, "string", cmd);
 		TCLAP::ValueArg<std::string> algorithmArg("a", "algorithm", "which hashing algorithm to use", false, "md5",
 												  &allowedAlgs, cmd);
 		TCLAP::SwitchArg			 linksArg("l", "link", "if specified, follow symbolic links", cmd);
+		TCLAP::SwitchArg			 listArg("0", "null", "read a NUL separated list of files from stdin instead of -p",
+											 cmd);
 		TCLAP::ValueArg<std::string> formatArg("f", "format", "output format", false, "gnu", &allowedFormats, cmd);
 		TCLAP::ValueArg<std::string> checksums("c", "checksums", "verify checksums in directory", false, "", "string",
 											   cmd);
 		TCLAP::ValueArg<std::string> output("o", "output", "output file", false, "", "string", cmd);
+		TCLAP::ValueArg<unsigned>	 jobsArg("j", "jobs", "number of files to hash in parallel", false, 1, "number",
+											 cmd);
+		TCLAP::ValueArg<std::string> scheduleArg("s", "schedule", "order in which files are hashed with -j",
+												 false, "depth-first", &allowedPolicies, cmd);
+		TCLAP::ValueArg<std::size_t> slowestArg("", "slowest", "print the N slowest files to stderr when done", false,
+												0, "N", cmd);
+		TCLAP::ValueArg<double>		 maxBpsArg("", "max-bps", "limit reading to this many bytes per second", false, 0,
+											   "bytes", cmd);
+		TCLAP::ValueArg<double>		 maxIopsArg("", "max-iops", "limit reading to this many reads per second", false, 0,
+												"number", cmd);
+		TCLAP::SwitchArg			 adaptiveArg("", "adaptive",
+												 "lower the read limits while read latency is above its average", cmd);
+		std::vector<std::string>			 cacheModes = {"normal", "dontneed", "direct"};
+		TCLAP::ValuesConstraint<std::string> allowedCacheModes(cacheModes);
+		TCLAP::ValueArg<std::string>		 cacheArg("", "cache",
+												  "page cache use: normal, dontneed drops what was read from disk, "
+												  "direct uses O_DIRECT",
+												  false, "normal", &allowedCacheModes, cmd);
+		TCLAP::SwitchArg			 idleArg("", "idle", "run with idle I/O priority and lowest CPU priority", cmd);
+		TCLAP::MultiArg<std::string> includeArg("", "include", "hash only files matching this glob", false, "glob",
+												cmd);
+		TCLAP::MultiArg<std::string> excludeArg("", "exclude", "skip files and directories matching this glob", false,
+												"glob", cmd);
+		TCLAP::ValueArg<std::uintmax_t> minSizeArg("", "min-size", "skip files smaller than this many bytes", false, 0,
+												   "bytes", cmd);
+		TCLAP::ValueArg<std::uintmax_t> maxSizeArg("", "max-size", "skip files larger than this many bytes", false,
+												   UINTMAX_MAX, "bytes", cmd);
+		TCLAP::ValueArg<std::string> newerArg("", "newer", "skip files modified before this time, @seconds or "
+											  "YYYY-MM-DD[ HH:MM:SS]", false, "", "time", cmd);
+		TCLAP::ValueArg<std::string> olderArg("", "older", "skip files modified at or after this time", false, "",
+											  "time", cmd);
+		TCLAP::SwitchArg			 hiddenArg("", "hidden", "include dot-files", cmd);
+		TCLAP::SwitchArg			 noIgnoreArg("", "no-ignore", "do not read .hasherignore files", cmd);
+		TCLAP::SwitchArg			 xdevArg("x", "one-file-system", "do not descend into other file systems", cmd);
+		TCLAP::MultiArg<std::string> deviceJobsArg("", "device-jobs",
+												   "files hashed at once per device with -j, N for all devices or "
+												   "PATH=N for the device of PATH, guessed from sysfs by default",
+												   false, "[PATH=]N", cmd);
+		TCLAP::ValueArg<std::string> daemonArg("", "daemon",
+											   "keep checksums up to date and serve them on this UNIX socket, with -o "
+											   "the output file is rewritten after every change",
+											   false, "", "socket", cmd);
+		TCLAP::ValueArg<unsigned>	 debounceArg("", "debounce",
+												 "with --daemon, milliseconds a file has to stay unchanged before it is "
+												 "hashed again",
+												 false, 500, "ms", cmd);
+		TCLAP::ValueArg<std::string> queryArg("", "query", "print the checksums served by a daemon", false, "",
+											  "socket", cmd);
+		TCLAP::ValueArg<std::size_t> bufferArg("b", "buffer",
+											   "KiB of finished checksums kept for in-order output with -j", false,
+											   64 * 1024, "number", cmd);
+		TCLAP::ValueArg<std::size_t> shardsArg("", "shards",
+											   "split the manifest written to -o into N files, -o becomes their index",
+											   false, 0, "N", cmd);
+		std::vector<std::string>			 shardKeys = {"directory", "hash"};
+		TCLAP::ValuesConstraint<std::string> allowedShardKeys(shardKeys);
+		TCLAP::ValueArg<std::string>		 shardByArg("", "shard-by",
+													"with --shards, keep top-level directories together or spread files "
+													"by the hash of their path",
+													false, "directory", &allowedShardKeys, cmd);
+		std::vector<std::string>			 reports = DiffReporterFactory::instance().getKeys();
+		TCLAP::ValuesConstraint<std::string> allowedReports(reports);
+		TCLAP::ValueArg<std::string>		 reportArg("", "report",
+												   "what verifying or comparing two paths prints: every file, only the "
+												   "changes, only the number of files per status or a json report of "
+												   "the changes",
+												   false, "all", &allowedReports, cmd);
+		TCLAP::SwitchArg			 noNumaArg("", "no-numa",
+											   "do not pin the workers of -j to NUMA nodes near the devices they read",
+											   cmd);
+		TCLAP::SwitchArg			 zstdArg("", "zstd",
+											 "compress the manifest written to -o with zstd, implied by a .zst suffix; "
+											 "compressed manifests given to -c are detected",
+											 cmd);
 
 		cmd.parse(argc, argv);
 
@@ -38,62 +124,185 @@ int main(int argc, char **argv) {
 		std::string checksumsPath = checksums.getValue();
 		bool		mode		  = !checksumsPath.empty();
 		bool		followLinks	  = linksArg.getValue();
-		std::string path		  = pathArg.getValue();
+		std::vector<std::string> paths = pathArg.getValue();
+		if (paths.empty()) paths.push_back(".");
+		if (paths.size() > 2) throw std::runtime_error("at most two paths can be given");
+		if (paths.size() == 2 && mode) throw std::runtime_error("cannot verify checksums of two paths");
+		std::string path		  = paths[0];
 		std::string algorithm	  = algorithmArg.getValue();
 		std::string format		  = formatArg.getValue();
+		if (listArg.getValue() && pathArg.isSet()) throw std::runtime_error("-0 and -p cannot be used together");
+		unsigned	jobs		  = jobsArg.getValue();
+		std::string schedule	  = scheduleArg.getValue();
 
 		// std::cout << "Calculating checksums for " << path << " using " << algorithm << " algorithm" << std::endl;
 		// std::cout << "Following symbolic links: " << (followLinks ? "yes" : "no") << std::endl;
 
+		if (adaptiveArg.getValue() && !maxBpsArg.isSet() && !maxIopsArg.isSet())
+			throw std::runtime_error("--adaptive needs --max-bps or --max-iops");
+		IOThrottle::instance().configure(maxBpsArg.getValue(), maxIopsArg.getValue(), adaptiveArg.getValue());
+		if (cacheArg.getValue() == "dontneed") ReadOptions::instance().cache = CacheMode::DontNeed;
+		if (cacheArg.getValue() == "direct") ReadOptions::instance().cache = CacheMode::Direct;
+		if (idleArg.getValue() && !setIdlePriority())
+			std::cerr << "warning: failed to lower priority: " << strerror(errno) << std::endl;
+
+		// filters applied while scanning
+		FilterChain filters;
+		if (!hiddenArg.getValue()) filters.add(std::make_unique<HiddenFilter>());
+		if (!noIgnoreArg.getValue()) filters.add(std::make_unique<IgnoreFileFilter>());
+		if (xdevArg.getValue()) filters.add(std::make_unique<OneFileSystemFilter>());
+		if (includeArg.isSet() || excludeArg.isSet())
+			filters.add(std::make_unique<GlobFilter>(includeArg.getValue(), excludeArg.getValue()));
+		if (minSizeArg.isSet() || maxSizeArg.isSet())
+			filters.add(std::make_unique<SizeFilter>(minSizeArg.getValue(), maxSizeArg.getValue()));
+		if (newerArg.isSet() || olderArg.isSet())
+			filters.add(std::make_unique<MTimeFilter>(
+				newerArg.isSet() ? parseTime(newerArg.getValue()) : std::chrono::system_clock::time_point::min(),
+				olderArg.isSet() ? parseTime(olderArg.getValue()) : std::chrono::system_clock::time_point::max()));
+
 		// create scanner
-		std::unique_ptr<FSTreeBuilder> builder = nullptr;
-		if (followLinks) builder = std::make_unique<FSTreeBuilderWithLinks>();
-		else builder = std::make_unique<FSTreeBuilderNoLinks>();
+		auto makeBuilder = [&]() -> std::unique_ptr<FSTreeBuilder> {
+			std::unique_ptr<FSTreeBuilder> builder;
+			if (followLinks) builder = std::make_unique<FSTreeBuilderWithLinks>();
+			else builder = std::make_unique<FSTreeBuilderNoLinks>();
+			builder->setFilter(&filters);
+			return builder;
+		};
+
+		if (queryArg.isSet()) {
+			std::cout << HashDaemon::query(queryArg.getValue());
+			return 0;
+		}
+
+		if (daemonArg.isSet()) {
+			if (mode || paths.size() == 2 || listArg.getValue() || followLinks)
+				throw std::runtime_error("--daemon works only on a single directory, without -c, -0 or -l");
+			if (format != "gnu") throw std::runtime_error("--daemon writes only the gnu format");
+			HashDaemon daemon(path, algorithm, &filters, std::chrono::milliseconds(debounceArg.getValue()), jobs);
+			daemon.listen(daemonArg.getValue());
+			if (!outputPath.empty()) daemon.setOutput(outputPath);
+
+			// SIGINT and SIGTERM stop the daemon cleanly, so that the socket is removed
+			static HashDaemon *running = &daemon;
+			auto			   handler = [](int) { running->stop(); };
+			std::signal(SIGINT, handler);
+			std::signal(SIGTERM, handler);
+			daemon.run();
+			return 0;
+		}
+
+		if (paths.size() == 2) {
+			// compare two directories
+			auto report = DiffReporterFactory::instance().create(reportArg.getValue(), std::cout);
+			diffTrees(makeBuilder, paths[0], paths[1], algorithm, *report);
+			report->finish();
+			return 0;
+		}
 
 		// scan directory
-		auto tree = builder->build(path);
+		std::unique_ptr<FSNode> tree = nullptr;
+		if (listArg.getValue()) tree = FSTreeListBuilder(followLinks).build(std::cin);
+		else if (StreamFile::isStream(path)) tree = std::make_unique<StreamFile>(path);
+		else tree = makeBuilder()->build(path);
 		if (!tree) throw std::runtime_error("failed to build tree");
 
-		auto calculator = ChecksumCalculatorFactory::instance().create(algorithm);
+		auto		   calculator = ChecksumCalculatorFactory::instance().create(algorithm);
+		SlowFileReport slowest(slowestArg.getValue());
+
+		// hash in parallel, writers take the results in traversal order
+		std::unique_ptr<HashScheduler> scheduler = nullptr;
+		// batch calculators need the scheduler to get more than one file at a time, with -j1 it hashes on the visiting
+		// thread
+		if (jobs > 1 || dynamic_cast<BatchChecksumCalculator *>(calculator.get())) {
+			DeviceLimits limits;
+			for (const auto &value : deviceJobsArg.getValue()) {
+				auto separator = value.rfind('=');
+				try {
+					if (separator == std::string::npos) limits.setDefault(std::stoul(value));
+					else limits.set(value.substr(0, separator), std::stoul(value.substr(separator + 1)));
+				} catch (const std::logic_error &) { throw std::runtime_error("invalid --device-jobs: " + value); }
+			}
+			auto policy = SchedulingPolicyFactory::instance().create(schedule);
+			scheduler	= std::make_unique<HashScheduler>(*tree, algorithm, *policy, jobs > 1 ? jobs : 0,
+															  bufferArg.getValue() << 10, limits,
+															  noNumaArg.getValue() ? nullptr : &NumaTopology::system());
+		}
 
 		if (!mode) {
 			// calculate checksums
 			std::unique_ptr<ProgressViewer> progress = nullptr;
 			std::ostream				   *os		 = &std::cout;
-			std::ofstream					ofs;
-			if (!outputPath.empty()) {
-				ofs.open(outputPath);
-				if (!ofs) throw std::runtime_error("failed to open file: "s + strerror(errno));
-				os = &ofs;
-			}
-			auto writer = HashStreamWriterFactory::instance().create(format, *calculator, *os);
+			std::unique_ptr<ManifestOStream> ofs;
+			bool							 compress = compressManifest(outputPath, zstdArg.getValue());
+			if (!outputPath.empty() && !shardsArg.getValue()) {
+				ofs = std::make_unique<ManifestOStream>(outputPath, compress);
+				os	= ofs.get();
+			} else if (compress && !shardsArg.getValue()) throw std::runtime_error("--zstd needs -o");
+			std::unique_ptr<HashStreamWriter> writer;
+			if (shardsArg.getValue()) {
+				if (outputPath.empty()) throw std::runtime_error("--shards needs -o");
+				auto by = shardByArg.getValue() == "hash" ? ShardIndex::Key::Hash : ShardIndex::Key::Directory;
+				writer	= std::make_unique<ShardedHashStreamWriter>(*calculator, *os, outputPath, format,
+																	shardsArg.getValue(), by, compress);
+			} else writer = HashStreamWriterFactory::instance().create(format, *calculator, *os);
+			writer->setScheduler(scheduler.get());
+			writer->BasicObservable<FileTiming>::addObserver(&slowest);
 
 			if (outputPath != "") { progress = std::make_unique<ProgressViewer>(tree.get(), writer.get(), std::cout); }
 
 			auto thread = std::thread([&] { tree->accept(*writer); });
 			//... can cancel
 			thread.join();
+			progress.reset();
+			writer.reset();	   // json writers write when destroyed
+			if (ofs) ofs->close();
 		} else {
 			// verify checksums
 
 			// read old checksums
-			std::ifstream is(checksumsPath);
-			if (!is) throw std::runtime_error("failed to open file: "s + strerror(errno));
-			auto	   reportBuilder = ReportDataBuilderFactory::instance().create(format);
-			ReportData oldTreeData	 = reportBuilder->build(is);
+			ManifestIStream is(checksumsPath);
+			std::optional<ShardIndex> index;
+			ReportData				  oldTreeData;
+			// only the part of the manifest at or below the verified directory is compared
+			std::filesystem::path subtree;
+			if (dynamic_cast<const Directory *>(tree.get()) && !listArg.getValue())
+				subtree = std::filesystem::relative(tree->path);
+			if (ShardIndex::isIndex(is)) index = ShardIndex::load(is);
+			else {
+				auto reportBuilder = ReportDataBuilderFactory::instance().create(format);
+				reportBuilder->setSubtree(subtree);
+				oldTreeData = reportBuilder->build(is);
+			}
 
 			// calculate new checksums
-			ReportData newTreeData;
-			auto	   treeWriter = ReportDataHashStreamWriter(*calculator, std::cerr, newTreeData);
-			auto progress = ProgressViewer(tree.get(), &treeWriter, std::cout);
-			auto	   thread	  = std::thread([&] { tree->accept(treeWriter); });
+			ReportData						  newTreeData;
+			std::unique_ptr<HashStreamWriter> treeWriter = nullptr;
+			if (format == "merkle")
+				treeWriter = std::make_unique<ReportDataMerkleHashStreamWriter>(*calculator, std::cerr, newTreeData);
+			else treeWriter = std::make_unique<ReportDataHashStreamWriter>(*calculator, std::cerr, newTreeData);
+			treeWriter->setScheduler(scheduler.get());
+			treeWriter->BasicObservable<FileTiming>::addObserver(&slowest);
+			// stdout is the report's, a json report has to stay parseable
+			auto progress = std::make_unique<ProgressViewer>(tree.get(), treeWriter.get(), std::cerr);
+			auto thread	  = std::thread([&] { tree->accept(*treeWriter); });
 			// ... can cancel
 			thread.join();
+			progress.reset();	 // the last line is drawn before the report
 
-			// compare
-			compare(oldTreeData, newTreeData, std::cout);
+			// compare, a sharded manifest shard by shard reading only the shards of the verified tree
+			auto report = DiffReporterFactory::instance().create(reportArg.getValue(), std::cout);
+			if (index) {
+				compareShards(*index, checksumsPath, std::move(newTreeData), subtree, jobs, *report);
+			} else {
+				sortReportData(oldTreeData);
+				sortReportData(newTreeData);
+				compare(oldTreeData, newTreeData, *report);
+			}
+			report->finish();
 		}
 
+		if (slowestArg.getValue()) slowest.print(std::cerr);
+
 	} catch (TCLAP::ArgException &e)	 // catch exceptions
 	{
 		std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
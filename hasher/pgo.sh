@@ -0,0 +1,34 @@
+#!/bin/sh
+# Profile guided build of main: an instrumented main hashes and verifies the training trees (by default the test
+# fixtures and the tree of the benchmark), then main is built again with the recorded profile.
+# Usage: ./pgo.sh [tree...]
+set -e
+build=build-pgo
+profile="$PWD/$build/pgo"
+
+cmake -S ./ -B $build -DCMAKE_BUILD_TYPE=Release -DHASHER_PGO=generate -DHASHER_PGO_DIR="$profile"
+cmake --build $build --target main bench -j"$(nproc)"
+rm -rf "$profile"
+
+if [ $# -eq 0 ]; then
+	$build/bench >/dev/null	# creates the benchmark tree
+	set -- test "${TMPDIR:-/tmp}/hasher_bench"
+fi
+manifest=$(mktemp)
+for tree in "$@"; do
+	for algorithm in md5 sha256 crc32c; do
+		for jobs in 1 4; do
+			./main -p "$tree" -a $algorithm -j $jobs >"$manifest"
+			./main -p "$tree" -a $algorithm -j $jobs -c "$manifest" >/dev/null
+		done
+		./main -p "$tree" -a $algorithm -f merkle >/dev/null
+	done
+done
+rm -f "$manifest"
+
+# clang writes raw profiles that have to be merged, gcc reads its .gcda files directly
+if ls "$profile"/*.profraw >/dev/null 2>&1; then
+	llvm-profdata merge -output="$profile/main.profdata" "$profile"/*.profraw
+fi
+cmake -S ./ -B $build -DHASHER_PGO=use
+cmake --build $build --target main -j"$(nproc)"
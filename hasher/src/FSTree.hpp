@@ -1,9 +1,16 @@
 #pragma once
 
 #include <filesystem>
+#include <map>
 #include <memory>
 #include <vector>
 #include <fstream>
+#include <sstream>
+#include <optional>
+#include <algorithm>
+
+#include <fileStream.hpp>
+#include <filters.hpp>
 
 class File;
 class Directory;
@@ -26,6 +33,7 @@ class FSNode : public FSAcceptor {
    public:
 	std::filesystem::path path;
 	std::uintmax_t		  size;
+	dev_t				  device = 0;	  // st_dev of the file system the node is on, 0 when not known
 
 	FSNode(const std::filesystem::path &path, std::uintmax_t size) : path(path), size(size) {}
 	virtual ~FSNode() = default;
@@ -42,7 +50,31 @@ class RegularFile : public File {
 	RegularFile(const std::filesystem::path &path) : File(path, std::filesystem::file_size(path)) {}
 
 	std::unique_ptr<std::istream> getStream() const override {
-		return std::unique_ptr<std::istream>(new std::ifstream(path, std::ios::binary));
+		return FileStream::open(path, std::clamp<std::uintmax_t>(size, 1 << 12, 1 << 20));
+	}
+
+	void accept(const FSVisitor &v) override { v.visit(*this); }
+	void accept(const FSVisitor &v) const override { v.visit(*this); }
+};
+
+/**
+ * @brief A pipe, character device or stdin ("-"). Its size is not known and it can be read only once.
+ */
+class StreamFile : public File {
+   public:
+	StreamFile(const std::filesystem::path &path) : File(path, 0) {}
+
+	static bool isStream(const std::filesystem::path &path) {
+		if (path == "-") return true;
+		std::error_code ec;
+		auto			type = std::filesystem::status(path, ec).type();
+		return !ec && (type == std::filesystem::file_type::fifo || type == std::filesystem::file_type::character ||
+					   type == std::filesystem::file_type::socket);
+	}
+
+	std::unique_ptr<std::istream> getStream() const override {
+		if (path == "-") return std::make_unique<FileStream>(STDIN_FILENO, false);
+		return FileStream::open(path);
 	}
 
 	void accept(const FSVisitor &v) override { v.visit(*this); }
@@ -78,56 +110,143 @@ class Directory : public FSNode {
 	void accept(const FSVisitor &v) const override { v.visit(*this); }
 };
 
+/**
+ * @brief Scans a directory tree. Entries below the root are offered to the filter before anything is done with them,
+ * so rejected directories are never read. Without a filter dot-files are skipped.
+ */
 class FSTreeBuilder {
+	static inline const HiddenFilter hidden;
+
+   protected:
+	const ScanFilter *filter = &hidden;
+
+	static std::unique_ptr<FSNode> tag(std::unique_ptr<FSNode> &&node, const ScanEntry &entry) {
+		node->device = entry.st.st_dev;
+		return std::move(node);
+	}
+
    public:
+	/**
+	 * @param filter not owned, nullptr restores the default
+	 */
+	void setFilter(const ScanFilter *filter) { this->filter = filter ? filter : &hidden; }
+
 	virtual std::unique_ptr<FSNode> build(const std::filesystem::path &path) = 0;
 	virtual ~FSTreeBuilder()												 = default;
 };
 
 class FSTreeBuilderNoLinks : public FSTreeBuilder {
    public:
-	std::unique_ptr<FSNode> build(const std::filesystem::path &path) override {
+	/**
+	 * @brief builds the subtree of an entry that was already accepted, entry.st from lstat
+	 */
+	std::unique_ptr<FSNode> build(const ScanEntry &entry) {
 		using namespace std::filesystem;
-		if(!exists(path) && !is_symlink(path)) throw std::runtime_error("path does not exist: " + path.string());
-		if (path.filename().string()[0] == '.') { return nullptr; }
-		if (is_directory(path) && !is_symlink(path)) {
+		if (S_ISDIR(entry.st.st_mode)) {
 			std::vector<std::unique_ptr<FSNode>> children;
-			for (auto &entry : directory_iterator(path)) {
-				auto child = build(entry.path());
-				if (child) { children.push_back(std::move(child)); }
+			for (auto &dirEntry : directory_iterator(entry.path)) {
+				ScanEntry child{dirEntry.path(), entry.relative / dirEntry.path().filename(), {}, &entry};
+				if (lstat(child.path.c_str(), &child.st) == -1)
+					throw std::runtime_error("path does not exist: " + child.path.string());
+				if (filter->accept(child)) children.push_back(build(child));
 			}
-			return std::make_unique<Directory>(path, std::move(children));
+			return tag(std::make_unique<Directory>(entry.path, std::move(children)), entry);
 		} else {
-			if (is_symlink(path)) return std::make_unique<SymLink>(path);
-			else return std::make_unique<RegularFile>(path);
+			if (S_ISLNK(entry.st.st_mode)) return tag(std::make_unique<SymLink>(entry.path), entry);
+			else return tag(std::make_unique<RegularFile>(entry.path), entry);
 		}
 	}
+
+	std::unique_ptr<FSNode> build(const std::filesystem::path &path) override {
+		ScanGuard scan(*filter);
+		ScanEntry root{path, {}, {}, nullptr};
+		if (lstat(path.c_str(), &root.st) == -1) throw std::runtime_error("path does not exist: " + path.string());
+		return build(root);
+	}
 };
 
 class FSTreeBuilderWithLinks : public FSTreeBuilder {
 	static const std::size_t max_path_size = 4096;
 
-   public:
-	std::unique_ptr<FSNode> build(const std::filesystem::path &path) override {
-		if(path.native().size() > max_path_size)
+	std::unique_ptr<FSNode> build(const ScanEntry &entry) {
+		if(entry.path.native().size() > max_path_size)
 			throw std::runtime_error("reached a path that is too long");
 
 		using namespace std::filesystem;
-		if(!exists(path) && !is_symlink(path)) throw std::runtime_error("path does not exist: " + path.string());
-		if (path.filename().string()[0] == '.') { return nullptr; }
-		if (is_directory(path)) {
+		if (S_ISDIR(entry.st.st_mode)) {
 			std::vector<std::unique_ptr<FSNode>> children;
-			for (auto &entry : directory_iterator(path, directory_options::follow_directory_symlink)) {
-				auto child = build(entry.path());
-				if (child) { children.push_back(std::move(child)); }
+			for (auto &dirEntry : directory_iterator(entry.path, directory_options::follow_directory_symlink)) {
+				ScanEntry child{dirEntry.path(), entry.relative / dirEntry.path().filename(), {}, &entry};
+				if (stat(child.path.c_str(), &child.st) == -1) continue;	 // dangling link
+				if (filter->accept(child)) children.push_back(build(child));
 			}
-			return std::make_unique<Directory>(path, std::move(children));
+			return tag(std::make_unique<Directory>(entry.path, std::move(children)), entry);
 		} else {
-			if (exists(path)) {
-				return std::make_unique<RegularFile>(path);
-			} else return nullptr;
+			return tag(std::make_unique<RegularFile>(entry.path), entry);
 		}
 	}
+
+   public:
+	std::unique_ptr<FSNode> build(const std::filesystem::path &path) override {
+		ScanGuard scan(*filter);
+		ScanEntry root{path, {}, {}, nullptr};
+		if (stat(path.c_str(), &root.st) == -1) throw std::runtime_error("path does not exist: " + path.string());
+		return build(root);
+	}
 };
 
+/**
+ * @brief Builds a tree from a list of file paths, like the output of find -print0, without scanning directories.
+ * Directories in the list are skipped, paths must be either all relative or all absolute.
+ */
+class FSTreeListBuilder {
+	struct Entry {
+		std::map<std::filesystem::path, Entry> children;
+		bool								   file = false;
+	};
+
+	bool followLinks;
+
+	std::unique_ptr<FSNode> make(const std::filesystem::path &path, const Entry &entry) const {
+		if (entry.file) {
+			std::unique_ptr<FSNode> node;
+			if (!followLinks && std::filesystem::is_symlink(path)) node = std::make_unique<SymLink>(path);
+			else node = std::make_unique<RegularFile>(path);
+			struct stat st;
+			if ((followLinks ? stat(path.c_str(), &st) : lstat(path.c_str(), &st)) == 0) node->device = st.st_dev;
+			return node;
+		}
+		std::vector<std::unique_ptr<FSNode>> children;
+		for (const auto &[name, child] : entry.children)
+			children.push_back(make(path / name, child));
+		return std::make_unique<Directory>(path, std::move(children));
+	}
 
+   public:
+	FSTreeListBuilder(bool followLinks = false) : followLinks(followLinks) {}
+
+	std::unique_ptr<FSNode> build(std::istream &is, char separator = '\0') {
+		Entry		root;
+		std::string line;
+		std::optional<bool> absolute;
+		while (std::getline(is, line, separator)) {
+			if (line.empty()) continue;
+			std::filesystem::path path = std::filesystem::path(line).lexically_normal();
+			if (absolute && *absolute != path.is_absolute())
+				throw std::runtime_error("cannot mix relative and absolute paths: " + line);
+			absolute = path.is_absolute();
+
+			if (std::filesystem::is_directory(followLinks ? std::filesystem::status(path)
+														  : std::filesystem::symlink_status(path)))
+				continue;
+			if (!std::filesystem::exists(std::filesystem::symlink_status(path)))
+				throw std::runtime_error("path does not exist: " + line);
+
+			Entry *entry = &root;
+			for (const auto &part : path.relative_path())
+				entry = &entry->children[part];
+			entry->file = true;
+		}
+		return make(absolute.value_or(false) ? "/" : ".", root);
+	}
+};
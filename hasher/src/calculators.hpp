@@ -1,60 +1,250 @@
 #pragma once
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <istream>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
 
 #include <openssl/evp.h>
+#if defined(__x86_64__)
+	#include <nmmintrin.h>
+#endif
+#if __has_include(<xxhash.h>)
+	#define XXH_INLINE_ALL
+	#include <xxhash.h>
+	#define HASHER_HAS_XXHASH
+#endif
 
 #include <factory.hpp>
 #include <thread>
 #include <utils.hpp>
 #include "observe.hpp"
 
-class ChecksumCalculator : public BasicObservable<uintmax_t> {
+class ChecksumCalculator : public ProgressObservable<uintmax_t> {
+	std::chrono::steady_clock::time_point lapStart;
+
    public:
 	virtual std::string calculate(std::istream &) = 0;
 	virtual ~ChecksumCalculator()				  = default;
+
+	/**
+	 * @brief time the last calculate() spent waiting for input and in the digest
+	 */
+	std::chrono::nanoseconds readTime{}, digestTime{};
+
+   protected:
+	void startLaps() {
+		readTime = digestTime = {};
+		lapStart			  = std::chrono::steady_clock::now();
+	}
+
+	/**
+	 * @brief adds the time since the previous lap to into
+	 */
+	void lap(std::chrono::nanoseconds &into) {
+		auto now = std::chrono::steady_clock::now();
+		into += now - lapStart;
+		lapStart = now;
+	}
+
+	static constexpr std::size_t blockSize = 1 << 20;
+
+	/**
+	 * @brief Reads the whole stream in blocks of blockSize bytes and passes them to update, an inlined call for every
+	 * calculator that instantiates it. The block is page aligned and at least as big as a FileStream's buffer, so files
+	 * are read straight into it, even with O_DIRECT.
+	 *
+	 * @return total number of bytes read
+	 */
+	template <class F>
+	std::uintmax_t readBlocks(std::istream &input, F &&update) {
+		if (!block) {
+			block.reset(static_cast<char *>(std::aligned_alloc(4096, blockSize)));
+			if (!block) throw std::bad_alloc();
+		}
+		std::streambuf *source		 = input.rdbuf();
+		std::uintmax_t	read_bytes	 = 0;
+		std::uintmax_t	byte_counter = 0;
+		startLaps();
+		while (std::streamsize count = source->sgetn(block.get(), blockSize)) {
+			lap(readTime);
+			update(block.get(), std::size_t(count));
+			lap(digestTime);
+			byte_counter += count;
+			read_bytes += count;
+			if (byte_counter >= (1 << 20)) {
+				byte_counter = 0;
+				notifyObservers(read_bytes);
+			}
+		}
+		lap(readTime);
+		if (byte_counter) notifyObservers(read_bytes);
+		return read_bytes;
+	}
+
+   private:
+	struct Free {
+		void operator()(char *p) const { std::free(p); }
+	};
+	std::unique_ptr<char[], Free> block;
+};
+
+/**
+ * @brief A calculator that can also hash several whole inputs at once. HashScheduler hands it batches of small files.
+ */
+class BatchChecksumCalculator {
+   public:
+	/**
+	 * @brief how many inputs are worth hashing together
+	 */
+	virtual std::size_t				 batchSize() const										 = 0;
+	virtual std::vector<std::string> calculate(const std::vector<std::string_view> &inputs) = 0;
+	virtual ~BatchChecksumCalculator()														 = default;
 };
 
+inline std::string toHex(const unsigned char *data, std::size_t len) {
+	static const char digits[] = "0123456789abcdef";
+	std::string		  result(2 * len, '0');
+	for (std::size_t i = 0; i < len; i++) {
+		result[2 * i]	  = digits[data[i] >> 4];
+		result[2 * i + 1] = digits[data[i] & 0xf];
+	}
+	return result;
+}
+
+/**
+ * @brief Digests from OpenSSL. The digest and its context are looked up and allocated once per calculator, every
+ * block goes straight to EVP_DigestUpdate.
+ */
 template <const EVP_MD *(*alg)()>
 class OpenSSLChecksumCalculator : public ChecksumCalculator {
+	const EVP_MD											*md;
+	std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX *)> context;
+
+	/**
+	 * @brief alg() fetched from its provider once, given the legacy object OpenSSL 3 looks the implementation up again
+	 * on every EVP_DigestInit_ex. Algorithms of providers that are not loaded fall back to alg().
+	 */
+	static const EVP_MD *fetched() {
+#if OPENSSL_VERSION_MAJOR >= 3
+		static const EVP_MD *implementation = EVP_MD_fetch(nullptr, EVP_MD_get0_name(alg()), nullptr);
+		if (implementation) return implementation;
+#endif
+		return alg();
+	}
+
    public:
+	OpenSSLChecksumCalculator() : md(fetched()), context(EVP_MD_CTX_new(), EVP_MD_CTX_free) {
+		if (!context) throw std::bad_alloc();
+	}
+
 	virtual std::string calculate(std::istream &input) override {
-		EVP_get_digestbyname("md5");
-		EVP_MD_CTX	 *context = EVP_MD_CTX_new();
-		const EVP_MD *md	  = alg();
 		unsigned char md_value[EVP_MAX_MD_SIZE];
 		unsigned int  md_len;
 
-		EVP_DigestInit(context, md);
-		char buffer[1024];
-		int	 byte_counter = 0;
-		int	 read_bytes	  = 0;
-		while (input.read(buffer, sizeof(buffer))) {
-			EVP_DigestUpdate(context, buffer, input.gcount());
-			byte_counter += input.gcount();
-			read_bytes += input.gcount();
-			if (byte_counter > (1 << 20)) {
-				byte_counter = 0;
-				notifyObservers(read_bytes);
-			}
+		if (!EVP_DigestInit_ex(context.get(), md, nullptr)) throw std::runtime_error("EVP_DigestInit_ex failed");
+		readBlocks(input, [&](const char *data, std::size_t len) { EVP_DigestUpdate(context.get(), data, len); });
+		EVP_DigestFinal_ex(context.get(), md_value, &md_len);
+		lap(digestTime);
+		return toHex(md_value, md_len);
+	}
+};
+
+/**
+ * @brief CRC-32C (Castagnoli), using the SSE4.2 crc32 instruction when the CPU supports it
+ */
+class CRC32CChecksumCalculator : public ChecksumCalculator {
+	static constexpr std::uint32_t polynomial = 0x82f63b78;
+
+	static constexpr auto makeTable() {
+		std::array<std::uint32_t, 256> table{};
+		for (std::uint32_t i = 0; i < 256; i++) {
+			std::uint32_t crc = i;
+			for (int j = 0; j < 8; j++)
+				crc = (crc >> 1) ^ (polynomial & (0u - (crc & 1)));
+			table[i] = crc;
 		}
-		using namespace std::literals;
-		//std::this_thread::sleep_for(300ms);
-		EVP_DigestUpdate(context, buffer, input.gcount());
-		read_bytes += input.gcount();
-		EVP_DigestFinal(context, md_value, &md_len);
-		EVP_MD_CTX_free(context);
-		std::string result;
-		result.resize(2 * md_len);
-		for (unsigned int i = 0; i < md_len; i++) {
-			sprintf(result.data() + 2 * i, "%02x", md_value[i]);
+		return table;
+	}
+
+   public:
+	static std::uint32_t updateSoftware(std::uint32_t crc, const char *data, std::size_t len) {
+		static constexpr auto table = makeTable();
+		for (std::size_t i = 0; i < len; i++)
+			crc = table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+		return crc;
+	}
+
+#if defined(__x86_64__)
+	__attribute__((target("sse4.2"))) static std::uint32_t updateHardware(std::uint32_t crc, const char *data,
+																		  std::size_t len) {
+		std::uint64_t crc64 = crc;
+		for (; len >= 8; len -= 8, data += 8) {
+			std::uint64_t word;
+			std::memcpy(&word, data, sizeof(word));
+			crc64 = _mm_crc32_u64(crc64, word);
 		}
-		if (input.gcount()) notifyObservers(read_bytes);
-		return result;
+		crc = std::uint32_t(crc64);
+		for (; len; len--, data++)
+			crc = _mm_crc32_u8(crc, *data);
+		return crc;
+	}
+
+	static bool hasHardwareSupport() {
+		static const bool supported = __builtin_cpu_supports("sse4.2");
+		return supported;
+	}
+#else
+	static std::uint32_t updateHardware(std::uint32_t crc, const char *data, std::size_t len) {
+		return updateSoftware(crc, data, len);
+	}
+
+	static bool hasHardwareSupport() { return false; }
+#endif
+
+	std::string calculate(std::istream &input) override {
+		std::uint32_t crc	   = ~0u;
+		bool		  hardware = hasHardwareSupport();
+		readBlocks(input, [&](const char *data, std::size_t len) {
+			crc = hardware ? updateHardware(crc, data, len) : updateSoftware(crc, data, len);
+		});
+		crc = ~crc;
+
+		unsigned char bytes[] = {(unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8),
+								 (unsigned char)crc};
+		return toHex(bytes, sizeof(bytes));
 	}
 };
 
+#ifdef HASHER_HAS_XXHASH
+/**
+ * @brief 128 bit XXH3, xxHash picks the widest vector unit available at compile time
+ */
+class XXH3_128ChecksumCalculator : public ChecksumCalculator {
+	std::unique_ptr<XXH3_state_t, XXH_errorcode (*)(XXH3_state_t *)> state;
+
+   public:
+	XXH3_128ChecksumCalculator() : state(XXH3_createState(), XXH3_freeState) {
+		if (!state) throw std::bad_alloc();
+	}
+
+	std::string calculate(std::istream &input) override {
+		XXH3_128bits_reset(state.get());
+		readBlocks(input, [&](const char *data, std::size_t len) { XXH3_128bits_update(state.get(), data, len); });
+
+		XXH128_canonical_t canonical;
+		XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state.get()));
+		return toHex(canonical.digest, sizeof(canonical.digest));
+	}
+};
+#endif
+
 using ChecksumCalculatorFactory = Factory<ChecksumCalculator>;
 
 // copy-pasta from openssl/evp.h
@@ -141,3 +331,10 @@ JOB(OpenSSLChecksumCalculator, {
 	ChecksumCalculatorFactory::instance().registerType<OpenSSLChecksumCalculator<EVP_sm3>>("sm3");
 #endif
 });
+
+JOB(FastChecksumCalculator, {
+	ChecksumCalculatorFactory::instance().registerType<CRC32CChecksumCalculator>("crc32c");
+#ifdef HASHER_HAS_XXHASH
+	ChecksumCalculatorFactory::instance().registerType<XXH3_128ChecksumCalculator>("xxh3_128");
+#endif
+});
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+#ifdef HASHER_HAS_ZSTD
+	#include <zstd.h>
+#endif
+
+/**
+ * @brief Bounded queue of chunks between two threads, the end of the data is an empty optional.
+ */
+class ChunkQueue {
+	std::deque<std::optional<std::string>> chunks;
+	std::size_t							   capacity;
+	bool								   closed = false;	   // the consumer is gone, pushing is pointless
+	std::mutex							   m;
+	std::condition_variable				   changed;
+
+   public:
+	ChunkQueue(std::size_t capacity) : capacity(capacity) {}
+
+	/**
+	 * @return false when the consumer has stopped
+	 */
+	bool push(std::optional<std::string> chunk) {
+		std::unique_lock lock(m);
+		changed.wait(lock, [&] { return closed || chunks.size() < capacity; });
+		if (closed) return false;
+		chunks.push_back(std::move(chunk));
+		changed.notify_all();
+		return true;
+	}
+
+	std::optional<std::string> pop() {
+		std::unique_lock lock(m);
+		changed.wait(lock, [&] { return !chunks.empty(); });
+		auto chunk = std::move(chunks.front());
+		chunks.pop_front();
+		changed.notify_all();
+		return chunk;
+	}
+
+	/**
+	 * @brief called by the consumer when it stops early, wakes up a waiting producer
+	 */
+	void close() {
+		std::lock_guard lock(m);
+		closed = true;
+		changed.notify_all();
+	}
+};
+
+#ifdef HASHER_HAS_ZSTD
+/**
+ * @brief Compresses everything written to it into a zstd frame on its own thread, so that the writer only copies
+ * into chunks. sync() does not flush, a frame is finished by close().
+ */
+class ZstdOutputBuffer : public std::streambuf {
+	static constexpr std::size_t chunkSize = 128 << 10;	   // a zstd block
+
+	std::ostream	  &sink;
+	std::string		   chunk;
+	ChunkQueue		   queue{4};
+	std::thread		   compressor;
+	std::exception_ptr error;
+	bool			   closed = false;
+
+	void compress(int level) {
+		std::unique_ptr<ZSTD_CCtx, std::size_t (*)(ZSTD_CCtx *)> context(ZSTD_createCCtx(), ZSTD_freeCCtx);
+		try {
+			if (!context) throw std::bad_alloc();
+			ZSTD_CCtx_setParameter(context.get(), ZSTD_c_compressionLevel, level);
+			ZSTD_CCtx_setParameter(context.get(), ZSTD_c_checksumFlag, 1);
+			std::string output(ZSTD_CStreamOutSize(), '\0');
+			while (true) {
+				auto				next = queue.pop();
+				ZSTD_EndDirective	mode = next ? ZSTD_e_continue : ZSTD_e_end;
+				ZSTD_inBuffer		input{next ? next->data() : nullptr, next ? next->size() : 0, 0};
+				std::size_t			remaining;
+				do {
+					ZSTD_outBuffer out{output.data(), output.size(), 0};
+					remaining = ZSTD_compressStream2(context.get(), &out, &input, mode);
+					if (ZSTD_isError(remaining))
+						throw std::runtime_error(std::string("zstd compression failed: ") + ZSTD_getErrorName(remaining));
+					sink.write(output.data(), out.pos);
+				} while (next ? input.pos < input.size : remaining != 0);
+				if (!sink) throw std::runtime_error("failed to write compressed output");
+				if (!next) return;
+			}
+		} catch (...) {
+			error = std::current_exception();
+			queue.close();
+		}
+	}
+
+	bool send() {
+		if (pptr() == pbase()) return true;
+		chunk.resize(pptr() - pbase());
+		bool sent = queue.push(std::move(chunk));
+		chunk.assign(chunkSize, '\0');
+		setp(chunk.data(), chunk.data() + chunk.size());
+		return sent;
+	}
+
+   protected:
+	int_type overflow(int_type c) override {
+		if (!send()) return traits_type::eof();
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize xsputn(const char *s, std::streamsize count) override {
+		for (std::streamsize written = 0; written < count;) {
+			if (pptr() == epptr() && !send()) return written;
+			std::streamsize n = std::min<std::streamsize>(count - written, epptr() - pptr());
+			std::memcpy(pptr(), s + written, n);
+			pbump(int(n));
+			written += n;
+		}
+		return count;
+	}
+
+   public:
+	ZstdOutputBuffer(std::ostream &sink, int level = 3) : sink(sink), chunk(chunkSize, '\0') {
+		setp(chunk.data(), chunk.data() + chunk.size());
+		compressor = std::thread(&ZstdOutputBuffer::compress, this, level);
+	}
+	ZstdOutputBuffer(const ZstdOutputBuffer &)			  = delete;
+	ZstdOutputBuffer &operator=(const ZstdOutputBuffer &) = delete;
+	~ZstdOutputBuffer() override {
+		try {
+			close();
+		} catch (const std::exception &) {}
+	}
+
+	/**
+	 * @brief compresses what is left and finishes the frame
+	 *
+	 * @throws std::runtime_error when compressing or writing failed
+	 */
+	void close() {
+		if (closed) return;
+		closed = true;
+		send();
+		queue.push(std::nullopt);
+		compressor.join();
+		if (error) std::rethrow_exception(error);
+	}
+};
+
+/**
+ * @brief Decompresses zstd frames read from source on its own thread, the reader takes whole decompressed chunks.
+ */
+class ZstdInputBuffer : public std::streambuf {
+	std::istream	  &source;
+	std::string		   chunk;
+	ChunkQueue		   queue{4};
+	std::thread		   decompressor;
+	std::exception_ptr error;
+	bool			   ended = false;
+
+	void decompress() {
+		std::unique_ptr<ZSTD_DCtx, std::size_t (*)(ZSTD_DCtx *)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+		try {
+			if (!context) throw std::bad_alloc();
+			std::string input(ZSTD_DStreamInSize(), '\0');
+			std::size_t pending = 0;	 // nonzero while a frame is incomplete
+			while (source.read(input.data(), input.size()) || source.gcount()) {
+				ZSTD_inBuffer in{input.data(), std::size_t(source.gcount()), 0};
+				bool		  full = false;	   // zstd may hold more output than fitted
+				while (in.pos < in.size || full) {
+					std::string	   output(ZSTD_DStreamOutSize(), '\0');
+					ZSTD_outBuffer out{output.data(), output.size(), 0};
+					pending = ZSTD_decompressStream(context.get(), &out, &in);
+					if (ZSTD_isError(pending))
+						throw std::runtime_error(std::string("zstd decompression failed: ") + ZSTD_getErrorName(pending));
+					full = out.pos == out.size;
+					output.resize(out.pos);
+					if (!output.empty() && !queue.push(std::move(output))) return;
+				}
+			}
+			if (pending) throw std::runtime_error("zstd decompression failed: truncated input");
+		} catch (...) { error = std::current_exception(); }
+		queue.push(std::nullopt);
+	}
+
+   protected:
+	int_type underflow() override {
+		if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+		if (ended) return traits_type::eof();
+		auto next = queue.pop();
+		if (!next) {
+			ended = true;
+			if (error) std::rethrow_exception(error);
+			return traits_type::eof();
+		}
+		chunk = std::move(*next);
+		setg(chunk.data(), chunk.data(), chunk.data() + chunk.size());
+		return traits_type::to_int_type(*gptr());
+	}
+
+   public:
+	ZstdInputBuffer(std::istream &source) : source(source) {
+		decompressor = std::thread(&ZstdInputBuffer::decompress, this);
+	}
+	ZstdInputBuffer(const ZstdInputBuffer &)			= delete;
+	ZstdInputBuffer &operator=(const ZstdInputBuffer &) = delete;
+	~ZstdInputBuffer() override {
+		queue.close();	   // a decompressor waiting for room stops
+		decompressor.join();
+	}
+};
+#endif
+
+/**
+ * @brief an output file, zstd compressed when asked to
+ */
+class ManifestOStream : public std::ostream {
+	std::ofstream file;
+#ifdef HASHER_HAS_ZSTD
+	std::unique_ptr<ZstdOutputBuffer> compressor;
+#endif
+
+   public:
+	ManifestOStream(const std::filesystem::path &path, bool compress) : std::ostream(nullptr), file(path, std::ios::binary) {
+		if (!file) throw std::runtime_error("failed to open file: " + path.string());
+		if (!compress) {
+			rdbuf(file.rdbuf());
+			return;
+		}
+#ifdef HASHER_HAS_ZSTD
+		compressor = std::make_unique<ZstdOutputBuffer>(file);
+		rdbuf(compressor.get());
+#else
+		throw std::runtime_error("built without zstd support");
+#endif
+	}
+
+	/**
+	 * @brief finishes the compressed frame and the file
+	 */
+	void close() {
+#ifdef HASHER_HAS_ZSTD
+		if (compressor) compressor->close();
+#endif
+		file.close();
+		if (!file) throw std::runtime_error("failed to write output");
+	}
+};
+
+/**
+ * @brief an input file, decompressed when it starts like a zstd frame
+ */
+class ManifestIStream : public std::istream {
+	std::ifstream file;
+#ifdef HASHER_HAS_ZSTD
+	std::unique_ptr<ZstdInputBuffer> decompressor;
+#endif
+
+   public:
+	static constexpr unsigned char zstdMagic[4] = {0x28, 0xb5, 0x2f, 0xfd};
+
+	ManifestIStream(const std::filesystem::path &path) : std::istream(nullptr), file(path, std::ios::binary) {
+		if (!file) throw std::runtime_error("failed to open file: " + path.string());
+		char magic[4] = {};
+		file.read(magic, sizeof(magic));
+		bool compressed = file.gcount() == sizeof(magic) && std::memcmp(magic, zstdMagic, sizeof(magic)) == 0;
+		file.clear();
+		file.seekg(0);
+		if (!compressed) {
+			rdbuf(file.rdbuf());
+			return;
+		}
+#ifdef HASHER_HAS_ZSTD
+		decompressor = std::make_unique<ZstdInputBuffer>(file);
+		rdbuf(decompressor.get());
+		exceptions(std::ios::badbit);	  // a corrupt frame is an error, not the end of the manifest
+#else
+		throw std::runtime_error("built without zstd support: " + path.string());
+#endif
+	}
+};
+
+/**
+ * @brief whether a manifest written to path is compressed, with the flag or a .zst suffix
+ */
+inline bool compressManifest(const std::filesystem::path &path, bool flag) { return flag || path.extension() == ".zst"; }
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <ranges>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <FSTree.hpp>
+#include <calculators.hpp>
+#include <compression.hpp>
+#include <filters.hpp>
+#include <reportData.hpp>
+#include <scheduler.hpp>
+#include <timing.hpp>
+#include <watcher.hpp>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * @brief Keeps the checksums of a directory tree up to date. The tree is hashed once, after that only the paths a
+ * Watcher reports are looked at again, once no event arrived for them for the debounce interval. Files that keep
+ * changing are therefore hashed when they settle down.
+ *
+ * The manifest, in the gnu format, can be rewritten to a file after every change and is sent to every client that
+ * connects to the UNIX socket given to listen().
+ */
+class HashDaemon : public Observer<WatchEvent> {
+	using clock = std::chrono::steady_clock;
+
+	/**
+	 * @brief hashes the files of a subtree into the manifest and watches its directories
+	 */
+	class Indexer : public FSVisitor {
+		HashDaemon	  &daemon;
+		HashScheduler *scheduler;
+
+	   public:
+		Indexer(HashDaemon &daemon, HashScheduler *scheduler) : daemon(daemon), scheduler(scheduler) {}
+
+		void visit(const File &node) const override {
+			auto relative = node.path.lexically_relative(daemon.root);
+			try {
+				daemon.manifest[relative] = scheduler ? scheduler->take(node).checksum
+													  : hashFile(*daemon.calc, node).checksum;
+			} catch (const std::exception &) {
+				daemon.manifest.erase(relative);	 // removed while it was read, the watcher reports that
+			}
+		}
+		void visit(const Directory &node) const override {
+			daemon.watcher->watch(node.path);
+			for (auto &child : node.children)
+				child->accept(*this);
+		}
+	};
+
+	std::filesystem::path				root;
+	std::string							algorithm;
+	HiddenFilter						hidden;
+	const ScanFilter				   *filter;
+	FSTreeBuilderNoLinks				builder;
+	std::unique_ptr<ChecksumCalculator> calc;
+	std::unique_ptr<Watcher>			watcher;
+	std::chrono::milliseconds			debounce;
+	unsigned							jobs;
+
+	std::map<std::filesystem::path, std::string>	   manifest;	 // relative path -> checksum
+	std::map<std::filesystem::path, clock::time_point> pending;		 // relative path -> when to look at it again
+
+	int					  listener = -1;
+	std::filesystem::path socketPath;
+	std::filesystem::path outputPath;
+	int					  stopEvent;
+
+	/**
+	 * @brief forgets everything at and below relative and scans it again
+	 */
+	void refresh(const std::filesystem::path &relative) {
+		for (auto it = manifest.lower_bound(relative); it != manifest.end() && isWithin(it->first, relative);)
+			it = manifest.erase(it);
+
+		// the filters see the same entries as during a full scan
+		ScanGuard			 scan(*filter);
+		std::list<ScanEntry> entries;
+		entries.push_back(ScanEntry{root, {}, {}, nullptr});
+		if (lstat(root.c_str(), &entries.back().st) == -1)
+			throw std::runtime_error("root disappeared: " + root.string());
+		for (const auto &part : relative) {
+			const ScanEntry &parent = entries.back();
+			entries.push_back(ScanEntry{parent.path / part, parent.relative / part, {}, &parent});
+			if (lstat(entries.back().path.c_str(), &entries.back().st) == -1) return;
+			if (!filter->accept(entries.back())) return;
+		}
+
+		try {
+			auto node = builder.build(entries.back());
+			std::unique_ptr<HashScheduler> scheduler;
+			if (jobs > 1 && entries.back().directory()) {
+				DepthFirstPolicy policy;
+				scheduler = std::make_unique<HashScheduler>(*node, algorithm, policy, jobs);
+			}
+			node->accept(Indexer(*this, scheduler.get()));
+		} catch (const std::exception &e) {
+			// it changed while it was scanned, the watcher reports the change
+			std::cerr << "warning: failed to scan " << entries.back().path.string() << ": " << e.what() << std::endl;
+		}
+	}
+
+	/**
+	 * @return whether anything was refreshed
+	 */
+	bool refreshDue() {
+		auto now = clock::now();
+		std::vector<std::filesystem::path> due;
+		for (const auto &[path, when] : pending)
+			if (when <= now) due.push_back(path);
+		for (const auto &path : due) {
+			pending.erase(path);
+			refresh(path);
+		}
+		return !due.empty();
+	}
+
+	int pollTimeout() const {
+		if (pending.empty()) return -1;
+		auto earliest = std::ranges::min(pending | std::views::values);
+		auto wait	  = std::chrono::ceil<std::chrono::milliseconds>(earliest - clock::now());
+		return std::max<long>(0, wait.count());
+	}
+
+	void serve() {
+		int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client == -1) return;
+		// a client that does not read can hold up the daemon only this long
+		timeval timeout = {5, 0};
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		std::ostringstream oss;
+		writeManifest(oss);
+		std::string text = oss.str();
+		for (std::size_t sent = 0; sent < text.size();) {
+			ssize_t count = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+			if (count == -1 && errno == EINTR) continue;
+			if (count <= 0) break;
+			sent += count;
+		}
+		close(client);
+	}
+
+	void writeOutput() const {
+		if (outputPath.empty()) return;
+		// replaced at once, readers never see a partial manifest
+		auto temporary = outputPath;
+		temporary += ".tmp";
+		{
+			ManifestOStream os(temporary, compressManifest(outputPath, false));
+			writeManifest(os);
+			os.close();
+		}
+		std::filesystem::rename(temporary, outputPath);
+	}
+
+   public:
+	/**
+	 * @param filter not owned, nullptr skips dot-files like the tree builders do
+	 * @param jobs files hashed in parallel when whole directories are scanned
+	 */
+	HashDaemon(const std::filesystem::path &root, const std::string &algorithm, const ScanFilter *filter = nullptr,
+			   std::chrono::milliseconds debounce = std::chrono::milliseconds(500), unsigned jobs = 1)
+		: root(root),
+		  algorithm(algorithm),
+		  filter(filter ? filter : &hidden),
+		  calc(ChecksumCalculatorFactory::instance().create(algorithm)),
+		  watcher(makeWatcher(root)),
+		  debounce(debounce),
+		  jobs(jobs),
+		  stopEvent(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {
+		if (!std::filesystem::is_directory(root)) throw std::runtime_error("not a directory: " + root.string());
+		if (stopEvent == -1) throw std::runtime_error(std::string("eventfd failed: ") + strerror(errno));
+		builder.setFilter(this->filter);
+		watcher->addObserver(this);
+	}
+	HashDaemon(const HashDaemon &)			  = delete;
+	HashDaemon &operator=(const HashDaemon &) = delete;
+	~HashDaemon() {
+		if (listener != -1) {
+			close(listener);
+			unlink(socketPath.c_str());
+		}
+		close(stopEvent);
+	}
+
+	/**
+	 * @brief serves the manifest on a UNIX socket, an existing socket at path is replaced
+	 */
+	void listen(const std::filesystem::path &path) {
+		sockaddr_un address = {.sun_family = AF_UNIX};
+		if (path.native().size() >= sizeof(address.sun_path))
+			throw std::runtime_error("socket path is too long: " + path.string());
+		std::strcpy(address.sun_path, path.c_str());
+
+		struct stat st;
+		if (lstat(path.c_str(), &st) == 0) {
+			if (!S_ISSOCK(st.st_mode)) throw std::runtime_error("not a socket: " + path.string());
+			unlink(path.c_str());
+		}
+		listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if (listener == -1) throw std::runtime_error(std::string("socket failed: ") + strerror(errno));
+		if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1 ||
+			::listen(listener, 16) == -1) {
+			int error = errno;
+			close(listener);
+			listener = -1;
+			throw std::runtime_error("failed to listen on " + path.string() + ": " + strerror(error));
+		}
+		socketPath = path;
+	}
+
+	/**
+	 * @brief rewrites the manifest to path after every change
+	 */
+	void setOutput(const std::filesystem::path &path) { outputPath = path; }
+
+	/**
+	 * @brief hashes the tree, then follows its changes until stop() is called
+	 */
+	void run() {
+		refresh({});
+		writeOutput();
+
+		pollfd fds[] = {{watcher->fd(), POLLIN, 0}, {stopEvent, POLLIN, 0}, {listener, POLLIN, 0}};
+		while (true) {
+			if (poll(fds, std::size(fds), pollTimeout()) == -1) {
+				if (errno == EINTR) continue;
+				throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
+			}
+			if (fds[1].revents) break;
+			if (fds[0].revents) watcher->process();
+			if (fds[2].revents) serve();
+			if (refreshDue()) writeOutput();
+		}
+	}
+
+	/**
+	 * @brief makes run() return, can be called from any thread
+	 */
+	void stop() { eventfd_write(stopEvent, 1); }
+
+	void update(const WatchEvent &event) override {
+		auto when = clock::now() + debounce;
+		if (event.kind == WatchEvent::Kind::Overflow) {
+			pending.clear();
+			pending[{}] = when;
+			return;
+		}
+		pending[event.path.lexically_relative(root)] = when;
+	}
+
+	/**
+	 * @brief writes the manifest in the gnu format, with paths like the ones HashStreamWriter writes
+	 */
+	void writeManifest(std::ostream &os) const {
+		// relative to the working directory like ReportWriter, a root of "." or "dir/" has no filename
+		auto base = std::filesystem::relative(root);
+		for (const auto &[relative, checksum] : manifest)
+			os << checksum << " *" << (base / relative).string() << '\n';
+	}
+
+	/**
+	 * @brief fetches the manifest from a daemon listening on path
+	 */
+	static std::string query(const std::filesystem::path &path) {
+		sockaddr_un address = {.sun_family = AF_UNIX};
+		if (path.native().size() >= sizeof(address.sun_path))
+			throw std::runtime_error("socket path is too long: " + path.string());
+		std::strcpy(address.sun_path, path.c_str());
+
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1) throw std::runtime_error(std::string("socket failed: ") + strerror(errno));
+		if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1) {
+			int error = errno;
+			close(fd);
+			throw std::runtime_error("failed to connect to " + path.string() + ": " + strerror(error));
+		}
+		std::string result;
+		char		buffer[1 << 16];
+		while (true) {
+			ssize_t count = read(fd, buffer, sizeof(buffer));
+			if (count == -1 && errno == EINTR) continue;
+			if (count <= 0) break;
+			result.append(buffer, count);
+		}
+		close(fd);
+		return result;
+	}
+};
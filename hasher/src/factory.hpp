@@ -1,33 +1,98 @@
 #pragma once
 
-#include <functional>
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <vector>
 
+#include <utils.hpp>
+
+/**
+ * @brief Creates objects by name. The registered types are kept in a table sorted by name, lookups read it without
+ * locking and without allocating, so they can come from any thread. Registrations are only queued, the first lookup
+ * after them builds and publishes a new table, so registering at load time costs next to nothing. A name that is
+ * registered again is replaced.
+ */
 template <class T, class ...Args>
 class Factory {
-	std::unordered_map<std::string, std::function<std::unique_ptr<T>(Args&&...)>> m_factories;
+	struct Entry {
+		std::string name;
+		std::unique_ptr<T> (*make)(Args &&...);
+	};
+	using Table = std::vector<Entry>;
+
+	std::atomic<std::shared_ptr<const Table>> table = std::make_shared<const Table>();
+	std::atomic<bool>						  dirty = false;	 // there are pending registrations
+	std::mutex								  writers;			 // guards pending and serializes the copies of the table
+	Table									  pending;
+
+	template <class U>
+	static std::unique_ptr<T> make(Args &&...args) {
+		return std::make_unique<U>(std::forward<Args>(args)...);
+	}
+
+	static const Entry *find(const Table &table, std::string_view name) {
+		auto it = std::ranges::lower_bound(table, name, {}, [](const Entry &entry) -> std::string_view { return entry.name; });
+		return it != table.end() && it->name == name ? &*it : nullptr;
+	}
+
+	/**
+	 * @return the table with all registrations so far
+	 */
+	std::shared_ptr<const Table> current() {
+		if (!dirty.load(std::memory_order_acquire)) return table.load();
+		std::lock_guard lock(writers);
+		if (!pending.empty()) {
+			auto copy = std::make_shared<Table>(*table.load());
+			for (auto &entry : pending) {
+				auto it = std::ranges::lower_bound(*copy, entry.name, {}, &Entry::name);
+				if (it != copy->end() && it->name == entry.name) it->make = entry.make;
+				else copy->insert(it, std::move(entry));
+			}
+			pending.clear();
+			table.store(std::move(copy));
+		}
+		dirty.store(false, std::memory_order_release);
+		return table.load();
+	}
 
    public:
 	template <class U>
 	void registerType(const std::string &name) {
-		m_factories[name] = [](Args&&... args) -> std::unique_ptr<T> { return std::make_unique<U>(std::forward<Args>(args)...); };
+		std::lock_guard lock(writers);
+		pending.push_back(Entry{name, make<U>});
+		dirty.store(true, std::memory_order_release);
 	}
 
-	std::unique_ptr<T> create(const std::string &name, Args &&...args) { return m_factories[name](std::forward<Args>(args)...); }
+	/**
+	 * @throws std::runtime_error when nothing is registered under name
+	 */
+	std::unique_ptr<T> create(std::string_view name, Args &&...args) {
+		auto		 table = current();
+		const Entry *entry = find(*table, name);
+		if (!entry) throw std::runtime_error("no " + type_name<T>() + " named \"" + std::string(name) + "\"");
+		return entry->make(std::forward<Args>(args)...);
+	}
 
-	bool exists(const std::string &name) { return m_factories.find(name) != m_factories.end(); }
+	bool exists(std::string_view name) { return find(*current(), name); }
 
 	static Factory &instance() {
 		static Factory instance;
 		return instance;
 	}
 
+	/**
+	 * @return the registered names in sorted order
+	 */
 	std::vector<std::string> getKeys() {
 		std::vector<std::string> keys;
-		for (const auto &pair : m_factories) {
-			keys.push_back(pair.first);
+		auto					 table = current();
+		for (const auto &entry : *table) {
+			keys.push_back(entry.name);
 		}
 		return keys;
 	}
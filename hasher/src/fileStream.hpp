@@ -0,0 +1,315 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <istream>
+#include <memory>
+#include <stdexcept>
+#include <streambuf>
+#include <vector>
+
+#include <throttle.hpp>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * @brief how reading files interacts with the page cache
+ */
+enum class CacheMode {
+	Normal,
+	DontNeed,	  // drop the pages that were read from disk, pages that were already cached stay
+	Direct,		  // O_DIRECT, falls back to DontNeed where the file system does not support it
+};
+
+/**
+ * @brief process-wide options for opening files with FileStream::open
+ */
+struct ReadOptions {
+	CacheMode cache	 = CacheMode::Normal;
+	bool	  sparse = true;	 // skip reading the holes of sparse files
+
+	static ReadOptions &instance() {
+		static ReadOptions instance;
+		return instance;
+	}
+};
+
+/**
+ * @brief Page aligned blocks kept by every thread for its next files, so that opening a file does not allocate and
+ * fault in a fresh buffer. The pages of a block are first touched by the thread that reads into it, a worker pinned
+ * to a NUMA node therefore reuses memory of its own node.
+ */
+class BlockPool {
+	static constexpr std::size_t keep = 4;	   // blocks kept per thread, a thread rarely reads more files at once
+
+	struct Cached {
+		char		*data;
+		std::size_t size;
+	};
+	std::vector<Cached> blocks;
+
+   public:
+	static constexpr std::size_t alignment = 4096;
+
+	struct Release {
+		std::size_t size;
+		void		operator()(char *p) const { local().give(p, size); }
+	};
+	using Block = std::unique_ptr<char[], Release>;
+
+	BlockPool() = default;
+	BlockPool(const BlockPool &)			= delete;
+	BlockPool &operator=(const BlockPool &) = delete;
+	~BlockPool() {
+		for (auto &block : blocks)
+			std::free(block.data);
+	}
+
+	static BlockPool &local() {
+		static thread_local BlockPool pool;
+		return pool;
+	}
+
+	/**
+	 * @param size rounded up to a multiple of the alignment
+	 */
+	static std::size_t roundUp(std::size_t size) { return (size + alignment - 1) / alignment * alignment; }
+
+	/**
+	 * @return the smallest cached block of at least size bytes, buffers are sized by the file so a larger one is fine
+	 */
+	Block take(std::size_t size) {
+		size	  = roundUp(size);
+		auto best = blocks.end();
+		for (auto it = blocks.begin(); it != blocks.end(); ++it)
+			if (it->size >= size && (best == blocks.end() || it->size < best->size)) best = it;
+		if (best != blocks.end()) {
+			Cached block = *best;
+			blocks.erase(best);
+			return Block(block.data, Release{block.size});
+		}
+		char *data = static_cast<char *>(std::aligned_alloc(alignment, size));
+		if (!data) throw std::bad_alloc();
+		return Block(data, Release{size});
+	}
+
+	/**
+	 * @brief keeps the largest blocks, they serve every size
+	 */
+	void give(char *data, std::size_t size) {
+		if (blocks.size() < keep) {
+			blocks.push_back({data, size});
+			return;
+		}
+		auto smallest = std::ranges::min_element(blocks, {}, &Cached::size);
+		if (smallest->size < size) {
+			std::swap(smallest->data, data);
+			smallest->size = size;
+		}
+		std::free(data);
+	}
+};
+
+/**
+ * @brief Read-only stream buffer over a file descriptor. Reads of at least the buffer's size go straight into the
+ * caller's memory, with O_DIRECT only if it is page aligned. Every read is subject to the IOThrottle.
+ *
+ * With setSparse() holes found with SEEK_DATA/SEEK_HOLE are not read, the get area points to a block of zeros instead.
+ */
+class FileBuffer : public std::streambuf {
+	static constexpr std::size_t alignment = BlockPool::alignment;
+
+	int				 fd;
+	bool			 owned;
+	CacheMode		 cache;
+	BlockPool::Block buffer;
+	std::size_t		 size;
+	off_t					  offset = 0;	  // position in the file
+
+	// sparse files are read with explicit offsets, [offset, dataEnd) is known to be data, [offset, holeEnd) a hole
+	bool  sparse  = false;
+	off_t dataEnd = 0, holeEnd = 0, fileSize = 0;
+
+	static constexpr std::size_t zeroSize = 1 << 16;
+	static inline const char	 zeros[zeroSize]{};
+
+	ssize_t readOnce(char *destination, std::size_t count) {
+		struct iovec iov	  = {destination, count};
+		off_t		 position = sparse ? offset : -1;
+		if (cache != CacheMode::DontNeed) return preadv2(fd, &iov, 1, position, 0);
+
+		// pages that are already cached are read without blocking and left alone
+		ssize_t cached = preadv2(fd, &iov, 1, position, RWF_NOWAIT);
+		if (cached >= 0) return cached;
+		if (errno != EAGAIN && errno != EOPNOTSUPP) return cached;
+
+		ssize_t bytes_read = preadv2(fd, &iov, 1, position, 0);
+		if (bytes_read > 0) posix_fadvise(fd, offset, bytes_read, POSIX_FADV_DONTNEED);
+		return bytes_read;
+	}
+
+	/**
+	 * @brief finds out whether offset is in a hole or in data, when it is past the known regions
+	 */
+	void locate() {
+		if (offset < dataEnd || offset < holeEnd || offset >= fileSize) return;
+		off_t data = lseek(fd, offset, SEEK_DATA);
+		if (data == -1) {
+			if (errno != ENXIO) throw std::runtime_error(std::string("lseek failed: ") + strerror(errno));
+			holeEnd = fileSize;		// only a hole until the end of the file
+			return;
+		}
+		holeEnd = data;
+		dataEnd = lseek(fd, data, SEEK_HOLE);
+		if (dataEnd == -1) dataEnd = fileSize;
+	}
+
+	/**
+	 * @brief whether a read can go straight into destination, O_DIRECT needs it aligned
+	 */
+	bool directInto(const char *destination, std::size_t count) const {
+		if (cache != CacheMode::Direct) return true;
+		return reinterpret_cast<std::uintptr_t>(destination) % alignment == 0 && count % alignment == 0;
+	}
+
+	bool inHole() {
+		if (!sparse) return false;
+		locate();
+		return offset < holeEnd;
+	}
+
+	/**
+	 * @return 0 at eof
+	 */
+	std::size_t readSome(char *destination, std::size_t count) {
+		if (sparse) {
+			locate();
+			if (offset < dataEnd) {
+				std::size_t data = dataEnd - offset;
+				// O_DIRECT reads whole blocks, the last data region may end anywhere in its block
+				if (cache == CacheMode::Direct) data = BlockPool::roundUp(data);
+				count = std::min(count, data);
+			}
+		}
+		while (true) {
+			auto	start	   = std::chrono::steady_clock::now();
+			ssize_t bytes_read = readOnce(destination, count);
+			if (bytes_read >= 0) {
+				auto &throttle = IOThrottle::instance();
+				if (throttle.enabled()) throttle.completed(bytes_read, std::chrono::steady_clock::now() - start);
+				offset += bytes_read;
+				return bytes_read;
+			}
+			if (errno == EAGAIN) {
+				struct pollfd pfd = {fd, POLLIN, 0};
+				poll(&pfd, 1, -1);
+			} else if (errno != EINTR) throw std::runtime_error(std::string("read failed: ") + strerror(errno));
+		}
+	}
+
+   public:
+	FileBuffer(int fd, bool owned, std::size_t size = 1 << 20, CacheMode cache = CacheMode::Normal)
+		: fd(fd),
+		  owned(owned),
+		  cache(cache),
+		  // O_DIRECT needs the buffer address and size aligned to the logical block size
+		  buffer(BlockPool::local().take(size)),
+		  size(BlockPool::roundUp(size)) {
+		setg(buffer.get(), buffer.get(), buffer.get());
+	}
+	FileBuffer(const FileBuffer &)			  = delete;
+	FileBuffer &operator=(const FileBuffer &) = delete;
+	~FileBuffer() override {
+		if (owned) close(fd);
+	}
+
+	/**
+	 * @brief skip holes from now on if the file has any. Only for regular files read from the start.
+	 *
+	 * @return whether the file is sparse
+	 */
+	bool setSparse() {
+		struct stat st;
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) return false;
+		// fewer allocated blocks than the size needs means there are holes
+		sparse	 = std::uintmax_t(st.st_blocks) * 512 < std::uintmax_t(st.st_size);
+		fileSize = st.st_size;
+		return sparse;
+	}
+
+   protected:
+	int_type underflow() override {
+		if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+		if (inHole()) {
+			std::size_t count = std::min<std::size_t>(zeroSize, holeEnd - offset);
+			offset += count;
+			char *z = const_cast<char *>(zeros);	 // the get area is never written to
+			setg(z, z, z + count);
+			return traits_type::to_int_type(*gptr());
+		}
+		std::size_t bytes_read = readSome(buffer.get(), size);
+		setg(buffer.get(), buffer.get(), buffer.get() + bytes_read);
+		if (bytes_read == 0) return traits_type::eof();
+		return traits_type::to_int_type(*gptr());
+	}
+
+	std::streamsize xsgetn(char *s, std::streamsize n) override {
+		std::streamsize done = std::min<std::streamsize>(n, egptr() - gptr());
+		std::memcpy(s, gptr(), done);
+		gbump(int(done));
+		while (done < n) {
+			std::size_t bytes_read;
+			if (std::size_t(n - done) >= size && directInto(s + done, n - done) && !inHole())
+				bytes_read = readSome(s + done, n - done);
+			else {
+				if (traits_type::eq_int_type(underflow(), traits_type::eof())) break;
+				bytes_read = std::min<std::size_t>(n - done, egptr() - gptr());
+				std::memcpy(s + done, gptr(), bytes_read);
+				gbump(int(bytes_read));
+			}
+			if (bytes_read == 0) break;
+			done += bytes_read;
+		}
+		return done;
+	}
+};
+
+/**
+ * @brief input stream over a file descriptor, read errors are thrown instead of only setting badbit
+ */
+class FileStream : public std::istream {
+	FileBuffer buffer;
+
+   public:
+	FileStream(int fd, bool owned, std::size_t bufferSize = 1 << 20, CacheMode cache = CacheMode::Normal)
+		: std::istream(&buffer), buffer(fd, owned, bufferSize, cache) {
+		exceptions(std::ios::badbit);
+	}
+
+	bool setSparse() { return buffer.setSparse(); }
+
+	/**
+	 * @brief opens a file for reading with the cache mode from ReadOptions
+	 */
+	static std::unique_ptr<FileStream> open(const std::filesystem::path &path, std::size_t bufferSize = 1 << 20) {
+		CacheMode cache = ReadOptions::instance().cache;
+		int		  fd	= -1;
+		if (cache == CacheMode::Direct) {
+			fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+			if (fd == -1 && errno == EINVAL) cache = CacheMode::DontNeed;
+		}
+		if (cache != CacheMode::Direct) fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1) throw std::runtime_error("failed to open " + path.string() + ": " + strerror(errno));
+		if (cache != CacheMode::Normal) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		auto stream = std::make_unique<FileStream>(fd, true, bufferSize, cache);
+		if (ReadOptions::instance().sparse) stream->setSparse();
+		return stream;
+	}
+};
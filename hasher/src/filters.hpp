@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+/**
+ * @brief A directory entry offered to a ScanFilter before the tree builder creates a node for it.
+ */
+struct ScanEntry {
+	std::filesystem::path path;			 // as the builder sees it
+	std::filesystem::path relative;		 // relative to the scanned root, empty for the root
+	struct stat			  st;			 // lstat, or stat when following links
+	const ScanEntry		 *parent;		 // the directory being scanned, nullptr for the root
+
+	bool directory() const { return S_ISDIR(st.st_mode); }
+};
+
+/**
+ * @brief Decides which entries of a directory make it into the tree. A rejected directory is not scanned at all.
+ */
+class ScanFilter {
+   public:
+	virtual bool accept(const ScanEntry &entry) const = 0;
+	virtual ~ScanFilter()							  = default;
+
+	/**
+	 * @brief called by the scanning thread when its scan is done, a filter drops what it kept for the scan
+	 */
+	virtual void scanned() const {}
+};
+
+/**
+ * @brief ends the scan of the calling thread when it goes out of scope, also when scanning throws
+ */
+class ScanGuard {
+	const ScanFilter &filter;
+
+   public:
+	ScanGuard(const ScanFilter &filter) : filter(filter) {}
+	ScanGuard(const ScanGuard &)			= delete;
+	ScanGuard &operator=(const ScanGuard &) = delete;
+	~ScanGuard() { filter.scanned(); }
+};
+
+/**
+ * @brief rejects dot-files and dot-directories, the default filter of the tree builders
+ */
+class HiddenFilter : public ScanFilter {
+   public:
+	bool accept(const ScanEntry &entry) const override { return entry.path.filename().native()[0] != '.'; }
+};
+
+/**
+ * @brief Matches a glob like gitignore does: a pattern without a slash matches the file name at any depth, otherwise
+ * the path relative to the root. A leading slash anchors a pattern without one, a trailing slash makes it match only
+ * directories.
+ */
+class Glob {
+	std::string pattern;
+	bool		anchored	  = false;
+	bool		directoryOnly = false;
+
+   public:
+	Glob(std::string pattern) {
+		if (pattern.size() > 1 && pattern.back() == '/') {
+			directoryOnly = true;
+			pattern.pop_back();
+		}
+		if (pattern.find('/') != std::string::npos) anchored = true;
+		if (pattern.starts_with('/')) pattern.erase(0, 1);
+		this->pattern = std::move(pattern);
+	}
+
+	bool matches(const std::filesystem::path &relative, bool directory) const {
+		if (directoryOnly && !directory) return false;
+		if (anchored) return fnmatch(pattern.c_str(), relative.c_str(), FNM_PATHNAME) == 0;
+		return fnmatch(pattern.c_str(), relative.filename().c_str(), 0) == 0;
+	}
+};
+
+/**
+ * @brief Rejects entries matching any exclude glob. With include globs, only files matching one of them are
+ * accepted, directories are still scanned so that matching files deeper in the tree are found.
+ */
+class GlobFilter : public ScanFilter {
+	std::vector<Glob> include, exclude;
+
+   public:
+	GlobFilter(const std::vector<std::string> &include, const std::vector<std::string> &exclude)
+		: include(include.begin(), include.end()), exclude(exclude.begin(), exclude.end()) {}
+
+	bool accept(const ScanEntry &entry) const override {
+		for (const auto &glob : exclude)
+			if (glob.matches(entry.relative, entry.directory())) return false;
+		if (include.empty() || entry.directory()) return true;
+		for (const auto &glob : include)
+			if (glob.matches(entry.relative, false)) return true;
+		return false;
+	}
+};
+
+/**
+ * @brief accepts files with size in [min, max], directories are not limited
+ */
+class SizeFilter : public ScanFilter {
+	std::uintmax_t min, max;
+
+   public:
+	SizeFilter(std::uintmax_t min, std::uintmax_t max = UINTMAX_MAX) : min(min), max(max) {}
+
+	bool accept(const ScanEntry &entry) const override {
+		return entry.directory() || (std::uintmax_t(entry.st.st_size) >= min && std::uintmax_t(entry.st.st_size) <= max);
+	}
+};
+
+/**
+ * @brief accepts files last modified in [after, before), directories are not limited
+ */
+class MTimeFilter : public ScanFilter {
+	using time_point = std::chrono::system_clock::time_point;
+	time_point after, before;
+
+   public:
+	MTimeFilter(time_point after, time_point before = time_point::max()) : after(after), before(before) {}
+
+	bool accept(const ScanEntry &entry) const override {
+		if (entry.directory()) return true;
+		auto mtime = time_point(std::chrono::duration_cast<time_point::duration>(
+			std::chrono::seconds(entry.st.st_mtim.tv_sec) + std::chrono::nanoseconds(entry.st.st_mtim.tv_nsec)));
+		return mtime >= after && mtime < before;
+	}
+};
+
+/**
+ * @brief does not cross into other file systems, like find -xdev
+ */
+class OneFileSystemFilter : public ScanFilter {
+   public:
+	bool accept(const ScanEntry &entry) const override {
+		return !entry.parent || entry.st.st_dev == entry.parent->st.st_dev;
+	}
+};
+
+/**
+ * @brief Applies the globs in the ignore files (.hasherignore) of every directory from the root down to the entry.
+ * One glob per line, see Glob; empty lines and lines starting with # are skipped, ! re-includes what an earlier glob
+ * excluded. The last matching glob decides.
+ */
+class IgnoreFileFilter : public ScanFilter {
+	struct Rule {
+		Glob glob;
+		bool negated;
+	};
+
+	struct Level {
+		std::filesystem::path directory;
+		std::vector<Rule>	  rules;
+	};
+
+	std::string name;
+	mutable std::mutex m;
+	// per scanning thread, the rules of the directories from the root down to the one being scanned, a scan starts
+	// without any so that it reads every ignore file again
+	mutable std::map<std::thread::id, std::vector<Level>> chains;
+
+	std::vector<Rule> load(const std::filesystem::path &directory) const {
+		std::vector<Rule> rules;
+		std::ifstream	  is(directory / name);
+		std::string		  line;
+		while (std::getline(is, line)) {
+			if (line.empty() || line[0] == '#') continue;
+			bool negated = line[0] == '!';
+			if (negated) line.erase(0, 1);
+			if (!line.empty()) rules.push_back(Rule{Glob(line), negated});
+		}
+		return rules;
+	}
+
+   public:
+	IgnoreFileFilter(std::string name = ".hasherignore") : name(std::move(name)) {}
+
+	bool accept(const ScanEntry &entry) const override {
+		if (entry.path.filename() == name) return false;
+		std::vector<const ScanEntry *> directories;
+		for (const ScanEntry *dir = entry.parent; dir; dir = dir->parent)
+			directories.push_back(dir);
+		std::reverse(directories.begin(), directories.end());
+
+		std::vector<Level> *chain;
+		{
+			std::lock_guard lock(m);
+			chain = &chains[std::this_thread::get_id()];	 // other threads never touch it
+		}
+		// the builders scan depth first, only the directories the scan has left are dropped
+		std::size_t depth = 0;
+		while (depth < chain->size() && depth < directories.size() &&
+			   (*chain)[depth].directory == directories[depth]->path)
+			depth++;
+		chain->erase(chain->begin() + depth, chain->end());
+		for (; depth < directories.size(); depth++)
+			chain->push_back({directories[depth]->path, load(directories[depth]->path)});
+
+		std::optional<bool> ignored;
+		// rules of directories closer to the entry come later and win
+		for (std::size_t i = 0; i < directories.size(); i++) {
+			auto relative = directories[i]->relative.empty() ? entry.relative
+															  : entry.relative.lexically_relative(directories[i]->relative);
+			for (const auto &rule : (*chain)[i].rules)
+				if (rule.glob.matches(relative, entry.directory())) ignored = !rule.negated;
+		}
+		return !ignored.value_or(false);
+	}
+
+	void scanned() const override {
+		std::lock_guard lock(m);
+		chains.erase(std::this_thread::get_id());
+	}
+};
+
+/**
+ * @brief accepts what all of its filters accept
+ */
+class FilterChain : public ScanFilter {
+	std::vector<std::unique_ptr<ScanFilter>> filters;
+
+   public:
+	FilterChain &add(std::unique_ptr<ScanFilter> &&filter) {
+		filters.push_back(std::move(filter));
+		return *this;
+	}
+
+	bool empty() const { return filters.empty(); }
+
+	bool accept(const ScanEntry &entry) const override {
+		for (const auto &filter : filters)
+			if (!filter->accept(entry)) return false;
+		return true;
+	}
+
+	void scanned() const override {
+		for (const auto &filter : filters)
+			filter->scanned();
+	}
+};
+
+/**
+ * @brief parses "@<seconds since the epoch>", "YYYY-MM-DD" or "YYYY-MM-DD HH:MM:SS" in local time
+ */
+inline std::chrono::system_clock::time_point parseTime(const std::string &text) {
+	if (text.starts_with('@')) {
+		std::size_t parsed = 0;
+		long long	seconds;
+		try {
+			seconds = std::stoll(text.substr(1), &parsed);
+		} catch (const std::exception &) { parsed = 0; }
+		if (parsed == 0 || parsed + 1 != text.size()) throw std::runtime_error("invalid time: " + text);
+		return std::chrono::system_clock::time_point(std::chrono::seconds(seconds));
+	}
+	for (const char *format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d"}) {
+		std::tm			   tm = {};
+		std::istringstream is(text);
+		is >> std::get_time(&tm, format);
+		if (is.fail() || is.peek() != std::char_traits<char>::eof()) continue;
+		tm.tm_isdst = -1;
+		return std::chrono::system_clock::from_time_t(std::mktime(&tm));
+	}
+	throw std::runtime_error("invalid time: " + text);
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+/**
+ * @brief parses a kernel cpulist like "0-3,8,10-11"
+ */
+inline std::vector<unsigned> parseCpuList(const std::string &text) {
+	std::vector<unsigned> cpus;
+	std::istringstream	  is(text);
+	for (std::string range; std::getline(is, range, ',');) {
+		unsigned		   first, last;
+		char			   dash;
+		std::istringstream rs(range);
+		if (!(rs >> first)) continue;
+		if (!(rs >> dash >> last) || dash != '-') last = first;
+		for (unsigned cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+/**
+ * @brief The NUMA nodes with CPUs this process may run on, read from sysfs. A machine without NUMA or without sysfs
+ * has a single node or none, both mean that placement does not matter.
+ */
+class NumaTopology {
+   public:
+	struct Node {
+		int					  id;
+		std::vector<unsigned> cpus;
+	};
+
+   private:
+	std::vector<Node>		nodes;
+	std::map<unsigned, int> nodeOfCpu;	   // every CPU, also the ones the process may not use
+
+	static std::string read(const std::filesystem::path &path) {
+		std::ifstream is(path);
+		std::string	  text;
+		std::getline(is, text);
+		return text;
+	}
+
+   public:
+	/**
+	 * @param root holds a node<N> directory with a cpulist for every node
+	 * @param allowedOnly drop the CPUs outside of the affinity mask of the process
+	 */
+	explicit NumaTopology(const std::filesystem::path &root = "/sys/devices/system/node", bool allowedOnly = true) {
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (allowedOnly && sched_getaffinity(0, sizeof(allowed), &allowed) == -1) allowedOnly = false;
+
+		std::error_code ec;
+		for (const auto &entry : std::filesystem::directory_iterator(root, ec)) {
+			auto name = entry.path().filename().string();
+			if (!name.starts_with("node") || name.size() == 4 ||
+				!std::all_of(name.begin() + 4, name.end(), [](char c) { return std::isdigit(c); }))
+				continue;
+			Node node{std::stoi(name.substr(4)), {}};
+			for (unsigned cpu : parseCpuList(read(entry.path() / "cpulist"))) {
+				nodeOfCpu[cpu] = node.id;
+				if (!allowedOnly || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) node.cpus.push_back(cpu);
+			}
+			if (!node.cpus.empty()) nodes.push_back(std::move(node));
+		}
+		std::ranges::sort(nodes, {}, &Node::id);
+	}
+
+	static const NumaTopology &system() {
+		static const NumaTopology topology;
+		return topology;
+	}
+
+	const std::vector<Node> &getNodes() const { return nodes; }
+
+	/**
+	 * @return -1 for an unknown CPU
+	 */
+	int nodeOf(unsigned cpu) const {
+		auto it = nodeOfCpu.find(cpu);
+		return it == nodeOfCpu.end() ? -1 : it->second;
+	}
+
+	/**
+	 * @brief The node closest to a block device: the node of most of the CPUs that serve the interrupts of its
+	 * controller, or the node the controller is attached to when the interrupts are spread out or unknown.
+	 *
+	 * @return -1 when it is not known, e.g. for file systems without a block device
+	 */
+	int deviceNode(dev_t device, const std::filesystem::path &sys = "/sys",
+				   const std::filesystem::path &proc = "/proc") const {
+		namespace fs = std::filesystem;
+		std::error_code ec;
+		fs::path		dir = fs::canonical(
+			   sys / "dev" / "block" / (std::to_string(major(device)) + ":" + std::to_string(minor(device))), ec);
+		if (ec) return -1;
+
+		// the controller is the first ancestor that knows its node
+		for (; dir.has_relative_path() && !fs::exists(dir / "numa_node"); dir = dir.parent_path())
+			;
+		if (!dir.has_relative_path()) return -1;
+
+		std::map<int, std::size_t> votes;
+		std::size_t				   total = 0;
+		for (const auto &irq : fs::directory_iterator(dir / "msi_irqs", ec)) {
+			auto irqDir = proc / "irq" / irq.path().filename();
+			auto list	= read(irqDir / "effective_affinity_list");
+			if (list.empty()) list = read(irqDir / "smp_affinity_list");
+			for (unsigned cpu : parseCpuList(list)) {
+				votes[nodeOf(cpu)]++;
+				total++;
+			}
+		}
+		for (auto [node, count] : votes)
+			if (node >= 0 && 2 * count > total) return node;
+
+		try {
+			return std::stoi(read(dir / "numa_node"));
+		} catch (const std::logic_error &) { return -1; }
+	}
+
+	/**
+	 * @brief restricts the calling thread to cpus
+	 *
+	 * @return false when that was not possible
+	 */
+	static bool pin(const std::vector<unsigned> &cpus) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned cpu : cpus)
+			if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+		return sched_setaffinity(0, sizeof(set), &set) == 0;
+	}
+};
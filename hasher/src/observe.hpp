@@ -1,15 +1,30 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <thread>
 #include <vector>
 #include <algorithm>
 
+/**
+ * @brief Defining HASHER_NO_OBSERVERS compiles the notifications of ProgressObservable out. Other observables keep
+ * notifying, something like the daemon depends on them.
+ */
+#ifdef HASHER_NO_OBSERVERS
+inline constexpr bool progressEnabled = false;
+#else
+inline constexpr bool progressEnabled = true;
+#endif
+
 template <class T>
 class Observer {
    public:
 	virtual void update(const T &) = 0;
-	~Observer() {}
+	virtual ~Observer()			   = default;
 };
 
 template <class T>
@@ -18,25 +33,74 @@ class Observable {
 	virtual void addObserver(Observer<T> *observer) {}
 	virtual void removeObserver(Observer<T> *observer) {}
 	virtual void notifyObservers(const T &) const {}
-	~Observable() {}
+	virtual ~Observable() = default;
 };
 
+/**
+ * @brief Observers are kept in a copy-on-write list: adding or removing one publishes a new list, notifying takes the
+ * current one, so notifications can come from any thread while observers are added or removed. Notifying never waits
+ * for a copy being made, but std::atomic<std::shared_ptr> is not lock-free in libstdc++, taking the list is a short
+ * internal lock. Without observers a notification is a single relaxed load.
+ */
 template <class T>
 class BasicObservable : public Observable<T> {
-	std::vector<Observer<T> *> observers;
+	using List = std::vector<Observer<T> *>;
+
+	std::atomic<std::shared_ptr<const List>> observers = std::make_shared<const List>();
+	std::atomic<bool>						 any	   = false;
+	std::atomic<bool>						 muted	   = false;
+	std::mutex								 writers;	  // serializes the copies of the list
+
+	template <class F>
+	void modify(F &&change) {
+		std::lock_guard lock(writers);
+		auto			list = std::make_shared<List>(*observers.load());
+		change(*list);
+		any.store(!list->empty(), std::memory_order_relaxed);
+		observers.store(std::move(list));
+	}
 
    public:
-	void addObserver(Observer<T> *observer) override { observers.push_back(observer); }
+	BasicObservable() = default;
+	BasicObservable(const BasicObservable &other) : observers(other.observers.load()), any(other.any.load()) {}
+	BasicObservable &operator=(const BasicObservable &other) {
+		observers = other.observers.load();
+		any		  = other.any.load();
+		return *this;
+	}
+
+	/**
+	 * @brief while muted, notifications are dropped
+	 */
+	void setMuted(bool muted) { this->muted.store(muted, std::memory_order_relaxed); }
+
+	void addObserver(Observer<T> *observer) override {
+		modify([&](List &list) { list.push_back(observer); });
+	}
 	void removeObserver(Observer<T> *observer) override {
-		observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+		modify([&](List &list) { list.erase(std::remove(list.begin(), list.end(), observer), list.end()); });
 	}
 	void notifyObservers(const T &v) const override {
-		for (auto observer : observers) {
+		if (!any.load(std::memory_order_relaxed) || muted.load(std::memory_order_relaxed)) return;
+		auto list = observers.load();	  // keeps the list alive, a temporary in the range would not be
+		for (auto observer : *list) {
 			observer->update(v);
 		}
 	}
 };
 
+/**
+ * @brief notifications that only show progress, observers can still be added but are never called when they are
+ * compiled out
+ */
+template <class T>
+class ProgressObservable : public BasicObservable<T> {
+   public:
+	void notifyObservers(const T &v) const override {
+		if constexpr (progressEnabled) BasicObservable<T>::notifyObservers(v);
+	}
+};
+
 template <class T>
 class ForwardObservable : public Observable<T> {
 	Observable<T> *observable;
@@ -47,3 +111,91 @@ class ForwardObservable : public Observable<T> {
 	void removeObserver(Observer<T> *observer) override { observable->removeObserver(observer); }
 	void notifyObservers(const T &v) const override { observable->notifyObservers(v); }
 };
+
+/**
+ * @brief Bounded lock-free queue for exactly one producer thread and one consumer thread.
+ */
+template <class T>
+class SPSCQueue {
+	std::vector<T>			 slots;
+	alignas(64) std::atomic<std::size_t> head = 0;	   // next slot to read, written by the consumer
+	alignas(64) std::atomic<std::size_t> tail = 0;	   // next slot to write, written by the producer
+
+   public:
+	SPSCQueue(std::size_t capacity) : slots(capacity + 1) {}
+
+	/**
+	 * @return false when the queue is full
+	 */
+	bool push(const T &value) {
+		std::size_t t	 = tail.load(std::memory_order_relaxed);
+		std::size_t next = (t + 1) % slots.size();
+		if (next == head.load(std::memory_order_acquire)) return false;
+		slots[t] = value;
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * @brief passes everything that is in the queue to f
+	 *
+	 * @return how many values were taken
+	 */
+	template <class F>
+	std::size_t drain(F &&f) {
+		std::size_t h	  = head.load(std::memory_order_relaxed);
+		std::size_t t	  = tail.load(std::memory_order_acquire);
+		std::size_t count = 0;
+		for (; h != t; h = (h + 1) % slots.size(), count++) {
+			f(slots[h]);
+			head.store((h + 1) % slots.size(), std::memory_order_release);
+		}
+		return count;
+	}
+};
+
+/**
+ * @brief Moves the work of an observer off the notifying thread. Notifications are queued and handed to the target
+ * observer in batches by a thread of its own, every interval. Only one thread may notify a QueuedObserver, when the
+ * queue is full it waits for room.
+ */
+template <class T>
+class QueuedObserver : public Observer<T> {
+	Observer<T>				 &target;
+	SPSCQueue<T>			  queue;
+	std::chrono::microseconds interval;
+	std::atomic<bool>		  stopped = false;
+	std::thread				  consumer;
+
+	void deliver() {
+		queue.drain([&](const T &value) { target.update(value); });
+	}
+
+   public:
+	QueuedObserver(Observer<T> &target, std::size_t capacity = 1024,
+				   std::chrono::microseconds interval = std::chrono::milliseconds(10))
+		: target(target), queue(capacity), interval(interval) {
+		consumer = std::thread([this] {
+			while (!stopped.load(std::memory_order_acquire)) {
+				deliver();
+				std::this_thread::sleep_for(this->interval);
+			}
+			deliver();
+		});
+	}
+	QueuedObserver(const QueuedObserver &)			  = delete;
+	QueuedObserver &operator=(const QueuedObserver &) = delete;
+
+	/**
+	 * @brief delivers what is still queued
+	 */
+	~QueuedObserver() override {
+		stopped.store(true, std::memory_order_release);
+		consumer.join();
+	}
+
+	void update(const T &value) override {
+		while (!queue.push(value))
+			std::this_thread::yield();
+	}
+};
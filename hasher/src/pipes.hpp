@@ -1,14 +1,23 @@
 #pragma once
 
 #include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <optional>
 #include <stdexcept>
 #include <streambuf>
 #include <istream>
+#include <string>
+#include <string_view>
 #include <unistd.h>
 
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
 #include <utils.hpp>
@@ -31,6 +40,48 @@ inline void waitWRITE(int pipe, int timeout = -1) {
 	if (poll(&pfd, 1, timeout) == -1) { throw std::runtime_error("poll failed"); }
 }
 
+/**
+ * @brief waits after a transfer between two file descriptors failed with EAGAIN. Either side may have been the one
+ * that would block, so the destination is waited for when it is full and the source otherwise. Polling only the
+ * source would return at once for a readable source and spin while the destination stays full.
+ */
+inline void waitTransfer(int from, int to) {
+	struct pollfd destination = {to, POLLOUT, 0};
+	if (poll(&destination, 1, 0) == -1) throw std::runtime_error("poll failed");
+	if (!destination.revents) waitWRITE(to);
+	else waitREAD(from);
+}
+
+/**
+ * @brief moves up to size bytes from one file descriptor to another inside the kernel, one of them must be a pipe
+ *
+ * @return number of bytes moved, stops early at eof
+ */
+inline std::size_t spliceAll(int from, int to, std::size_t size = SIZE_MAX) {
+	std::size_t moved = 0;
+	while (moved < size) {
+		ssize_t result = splice(from, nullptr, to, nullptr, std::min<std::size_t>(size - moved, 1 << 20), SPLICE_F_MOVE);
+		if (result > 0) moved += result;
+		else if (result == 0) break;
+		else if (errno == EAGAIN) waitTransfer(from, to);
+		else if (errno != EINTR) throw std::runtime_error(std::string("splice failed: ") + strerror(errno));
+	}
+	return moved;
+}
+
+inline void setNonBlocking(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		throw std::runtime_error(std::string("fcntl failed: ") + strerror(errno));
+}
+
+/**
+ * @brief stream buffer over a pipe. Works with blocking and non-blocking pipes, reading returns eof once the other end
+ * is closed. Data that was already read from the pipe by someone else can be handed back with feed().
+ *
+ * Reads and writes of at least BUFFER_SIZE bytes bypass the internal buffers. With setTee() everything read is first
+ * duplicated into another pipe with tee(2), so a stream can be hashed and forwarded without copying it in user space.
+ */
 class PipeBuffer : public std::streambuf {
    public:
 	explicit PipeBuffer(int pipe_fd) : pipe_fd(pipe_fd) {
@@ -40,17 +91,84 @@ class PipeBuffer : public std::streambuf {
 	}
 	~PipeBuffer() override { sync(); }
 
+	void reset(int pipe_fd) {
+		sync();
+		this->pipe_fd = pipe_fd;
+		drained.clear();
+		setg(buffer, buffer, buffer);
+		setp(output_buffer, output_buffer + BUFFER_SIZE);
+	}
+
+	/**
+	 * @brief appends data that was read from the pipe elsewhere, it is returned after everything buffered so far
+	 */
+	void feed(std::string_view data) {
+		if (eback() == drained.data() && !drained.empty()) {
+			std::size_t offset = gptr() - eback();
+			drained.append(data);
+			setg(drained.data(), drained.data() + offset, drained.data() + drained.size());
+		} else drained.append(data);
+	}
+
+	/**
+	 * @brief duplicate everything read from now on into the pipe tee_fd, -1 turns it off. Both ends must be pipes.
+	 */
+	void setTee(int tee_fd) {
+		this->tee_fd = tee_fd;
+		teed		 = 0;
+	}
+
+	/**
+	 * @brief everything that can be read without touching the pipe
+	 */
+	std::string takeBuffered() {
+		std::string result(gptr(), egptr());
+		if (eback() != drained.data()) result += drained;
+		drained.clear();
+		setg(buffer, buffer, buffer);
+		return result;
+	}
+
    protected:
 	int_type underflow() override {
-		if (gptr() == egptr()) {
-			ssize_t bytes_read = read(pipe_fd, buffer, BUFFER_SIZE);
-			if (bytes_read <= 0) { throw std::runtime_error("failed to read from pipe"); }
+		if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
 
-			setg(buffer, buffer, buffer + bytes_read);
+		if (eback() == drained.data() && !drained.empty()) drained.clear();
+		if (!drained.empty()) {
+			setg(drained.data(), drained.data(), drained.data() + drained.size());
+			return traits_type::to_int_type(*gptr());
 		}
+
+		ssize_t bytes_read = readPipe(buffer, BUFFER_SIZE);
+		if (bytes_read == 0) return traits_type::eof();
+		setg(buffer, buffer, buffer + bytes_read);
 		return traits_type::to_int_type(*gptr());
 	}
 
+	std::streamsize xsgetn(char *s, std::streamsize n) override {
+		std::streamsize done = 0;
+		while (done < n) {
+			if (gptr() == egptr() && (eback() == drained.data() || drained.empty()) && n - done >= BUFFER_SIZE) {
+				ssize_t bytes_read = readPipe(s + done, n - done);
+				if (bytes_read == 0) break;
+				done += bytes_read;
+				continue;
+			}
+			if (gptr() == egptr() && traits_type::eq_int_type(underflow(), traits_type::eof())) break;
+			std::streamsize chunk = std::min<std::streamsize>(n - done, egptr() - gptr());
+			std::memcpy(s + done, gptr(), chunk);
+			gbump(int(chunk));
+			done += chunk;
+		}
+		return done;
+	}
+
+	std::streamsize xsputn(const char *s, std::streamsize n) override {
+		if (n < BUFFER_SIZE) return std::streambuf::xsputn(s, n);
+		if (sync() == -1 || !writePipe(s, n)) return 0;
+		return n;
+	}
+
 	int_type overflow(int_type ch) override {
 		if (sync() == -1) { return traits_type::eof(); }
 		if (ch != traits_type::eof()) {
@@ -61,27 +179,61 @@ class PipeBuffer : public std::streambuf {
 	}
 
 	int sync() override {
-		ssize_t bytes_to_write = pptr() - pbase();
-		if (bytes_to_write > 0) {
-			ssize_t bytes_written = write(pipe_fd, output_buffer, bytes_to_write);
-			if (bytes_written <= 0) {
-				waitWRITE(pipe_fd);
-				bytes_written = write(pipe_fd, output_buffer, bytes_to_write);
+		if (!writePipe(pbase(), pptr() - pbase())) return -1;
+		setp(output_buffer, output_buffer + BUFFER_SIZE);
+		return 0;
+	}
+
+   private:
+	/**
+	 * @brief reads at most size bytes, teeing them first if requested
+	 *
+	 * @return 0 at eof
+	 */
+	ssize_t readPipe(char *destination, std::size_t size) {
+		if (pipe_fd == -1) return 0;
+		while (tee_fd != -1 && teed == 0) {
+			ssize_t result = tee(pipe_fd, tee_fd, std::max<std::size_t>(size, BUFFER_SIZE), 0);
+			if (result > 0) teed = result;
+			else if (result == 0) break;
+			else if (errno == EAGAIN) waitTransfer(pipe_fd, tee_fd);
+			else if (errno != EINTR) throw std::runtime_error(std::string("tee failed: ") + strerror(errno));
+		}
+		// only consume what was duplicated, otherwise the next tee would miss it
+		if (tee_fd != -1) size = std::min(size, teed);
+
+		while (true) {
+			ssize_t bytes_read = read(pipe_fd, destination, size);
+			if (bytes_read >= 0) {
+				if (tee_fd != -1) teed -= bytes_read;
+				return bytes_read;
 			}
+			if (errno == EAGAIN) waitREAD(pipe_fd);
+			else if (errno != EINTR) throw std::runtime_error(std::string("failed to read from pipe: ") + strerror(errno));
+		}
+	}
 
-			if (bytes_written < 0) {
+	bool writePipe(const char *data, std::size_t size) {
+		while (size > 0) {
+			ssize_t bytes_written = write(pipe_fd, data, size);
+			if (bytes_written >= 0) {
+				data += bytes_written;
+				size -= bytes_written;
+			} else if (errno == EAGAIN) waitWRITE(pipe_fd);
+			else if (errno != EINTR) {
 				dbLog(dbg::LOG_WARNING, "Failed to write to pipe: ", strerror(errno));
-				return -1;
+				return false;
 			}
-			pbump(-bytes_written);
 		}
-		return 0;
+		return true;
 	}
 
-   private:
-	int	 pipe_fd;
-	char buffer[BUFFER_SIZE];
-	char output_buffer[BUFFER_SIZE];
+	int			pipe_fd;
+	int			tee_fd = -1;
+	std::size_t teed   = 0;		// bytes duplicated by tee but not read yet
+	char		buffer[BUFFER_SIZE];
+	char		output_buffer[BUFFER_SIZE];
+	std::string drained;
 };
 
 class Pipe {
@@ -94,6 +246,7 @@ class Pipe {
 		s.pipe	   = -1;
 	}
 	Pipe &operator=(Pipe &&s) {
+		if (this->pipe != -1) close(this->pipe);
 		this->pipe = s.pipe;
 		s.pipe	   = -1;
 		return *this;
@@ -124,92 +277,257 @@ class PipeStream : public std::iostream {
 	PipeStream(int pipe) : std::iostream(&buffer), buffer(pipe), pipe(nullptr) {}
 
 	~PipeStream() override { this->flush(); }
-	PipeStream &operator=(PipeStream &&s) {
-		this->buffer = std::move(s.buffer);
-		this->pipe	 = s.pipe;
-		s.pipe		 = nullptr;
-		return *this;
-	}
 	const Pipe &getpipe() { return *pipe; }
 
+	void open(const Pipe &s) {
+		buffer.reset(s);
+		pipe = &s;
+		clear();
+	}
+	void		feed(std::string_view data) { buffer.feed(data); }
+	std::string takeBuffered() { return buffer.takeBuffered(); }
+
+	/**
+	 * @brief forward everything read from this stream into the pipe fd as well, without copying it
+	 */
+	void tee(int fd) { buffer.setTee(fd); }
+
    private:
 	PipeBuffer	buffer;		// Our custom stream buffer
 	const Pipe *pipe;
 };
 
+/**
+ * @brief Child process with piped stdin, stdout and stderr. While waiting, stdout and stderr are drained together
+ * through epoll, so a child that fills one pipe while the other is being read cannot deadlock. Drained output is
+ * read through out() and err() as usual. The child is reaped through a pidfd where the kernel supports it.
+ */
 class Process {
    public:
 	Process(const Process &)			= delete;
 	Process &operator=(const Process &) = delete;
-	Process(Process &&s) {
-		this->pid = s.pid;
-		s.pid	  = -1;
-	}
-	Process &operator=(Process &&s) {
-		this->pid = s.pid;
-		s.pid	  = -1;
-		return *this;
-	}
 
-	template<typename... Args>
+	template <typename... Args>
 	Process(const char *path, const Args... args) : pid(-1) {
-		int in_pipe[2], out_pipe[2], err_pipe[2];
-		if (pipe(in_pipe) == -1) { throw std::runtime_error("pipe failed"); }
-		if (pipe(out_pipe) == -1) { throw std::runtime_error("pipe failed"); }
-		if (pipe(err_pipe) == -1) { throw std::runtime_error("pipe failed"); }
+		int in_fds[2], out_fds[2], err_fds[2];
+		if (pipe2(in_fds, O_CLOEXEC) == -1) { throw std::runtime_error("pipe failed"); }
+		in_pipe = in_fds[1];
+		Pipe child_in(in_fds[0]);
+		if (pipe2(out_fds, O_CLOEXEC) == -1) { throw std::runtime_error("pipe failed"); }
+		out_pipe = out_fds[0];
+		Pipe child_out(out_fds[1]);
+		if (pipe2(err_fds, O_CLOEXEC) == -1) { throw std::runtime_error("pipe failed"); }
+		err_pipe = err_fds[0];
+		Pipe child_err(err_fds[1]);
 
 		pid = fork();
 		if (pid == -1) { throw std::runtime_error("fork failed"); }
 
 		if (pid == 0) {
-			close(in_pipe[1]);
-			close(out_pipe[0]);
-			close(err_pipe[0]);
-
-			dup2(in_pipe[0], STDIN_FILENO);
-			dup2(out_pipe[1], STDOUT_FILENO);
-			dup2(err_pipe[1], STDERR_FILENO);
-
-			close(in_pipe[0]);
-			close(out_pipe[1]);
-			close(err_pipe[1]);
+			dup2(child_in, STDIN_FILENO);
+			dup2(child_out, STDOUT_FILENO);
+			dup2(child_err, STDERR_FILENO);
 
 			execlp(path, path, args..., nullptr);
-			exit(1);
+			_exit(127);
 		}
 
-		close(in_pipe[0]);
-		close(out_pipe[1]);
-		close(err_pipe[1]);
+		setNonBlocking(out_pipe);
+		setNonBlocking(err_pipe);
+		in_stream.open(in_pipe);
+		out_stream.open(out_pipe);
+		err_stream.open(err_pipe);
+
+		epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll == -1) throw std::runtime_error(std::string("epoll_create1 failed: ") + strerror(errno));
+		watch(out_pipe, EPOLLIN);
+		watch(err_pipe, EPOLLIN);
 
-		in_stream	= in_pipe[1];
-		out_stream = out_pipe[0];
-		err_stream = err_pipe[0];
+		pidfd = int(syscall(SYS_pidfd_open, pid, 0));
+		if (pidfd != -1) watch(pidfd, EPOLLIN);
 	}
+
+	/**
+	 * @brief kills and reaps the child if it is still running
+	 */
 	~Process() {
 		if (pid != -1) {
-			std::terminate();
+			kill(SIGKILL);
+			int status;
+			while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+				;
 		}
 	}
 
-	int wait() {
-		int status;
-		waitpid(pid, &status, 0);
-		pid = -1;
+	/**
+	 * @brief closes the child's stdin, waits for it to exit and collects all of its output
+	 *
+	 * @return the status reported by waitpid
+	 */
+	int wait() { return *waitFor(std::nullopt); }
+
+	/**
+	 * @brief like wait(), but gives up after timeout
+	 *
+	 * @return the status, or nullopt if the child is still running
+	 */
+	std::optional<int> waitFor(std::optional<std::chrono::milliseconds> timeout) {
+		closeIn();
+		auto deadline = timeout ? std::chrono::steady_clock::now() + *timeout : std::chrono::steady_clock::time_point::max();
+		// pump() returns early while output keeps coming, and every 10 ms without a pidfd; -1 waits without a deadline
+		while (pid != -1 && remaining(deadline) != 0)
+			pump(remaining(deadline));
+		if (pid != -1) return std::nullopt;
+		while (pump(0))
+			;
 		return status;
 	}
 
+	/**
+	 * @brief writes input to the child's stdin while draining its output, then waits for it
+	 */
+	int communicate(std::string_view input) {
+		in_stream.flush();
+		setNonBlocking(in_pipe);
+
+		// a child that exits without reading its input must not kill us with SIGPIPE
+		sigset_t pipeSignal, oldMask;
+		sigemptyset(&pipeSignal);
+		sigaddset(&pipeSignal, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &pipeSignal, &oldMask);
+
+		bool broken = false;
+		while (!input.empty() && !broken) {
+			ssize_t written = ::write(in_pipe, input.data(), input.size());
+			if (written >= 0) input.remove_prefix(written);
+			else if (errno == EAGAIN) {
+				struct pollfd pfd = {int(in_pipe), POLLOUT, 0};
+				while (::poll(&pfd, 1, 0) == 0)
+					pump(10);
+			} else if (errno == EPIPE) broken = true;
+			else if (errno != EINTR) {
+				pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+				throw std::runtime_error(std::string("failed to write to pipe: ") + strerror(errno));
+			}
+		}
+		if (broken) {
+			struct timespec zero = {};
+			sigtimedwait(&pipeSignal, nullptr, &zero);
+		}
+		pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+		return wait();
+	}
+
+	/**
+	 * @brief reads whatever stdout has available, waiting at most timeout for something to arrive (0 does not block)
+	 */
+	std::string readOut(std::chrono::milliseconds timeout = {}) { return readSome(out_stream, out_pipe, timeout); }
+	std::string readErr(std::chrono::milliseconds timeout = {}) { return readSome(err_stream, err_pipe, timeout); }
+
+	void closeIn() {
+		if (in_pipe == -1) return;
+		in_stream.flush();
+		in_pipe = Pipe();
+		in_stream.open(in_pipe);
+	}
+
+	void kill(int signal = SIGTERM) {
+		if (pid == -1) return;
+		if (pidfd == -1 || syscall(SYS_pidfd_send_signal, int(pidfd), signal, nullptr, 0) == -1) ::kill(pid, signal);
+	}
+
+	bool running() const { return pid != -1; }
+
 	PipeStream &in() { return in_stream; }
 	PipeStream &out() { return out_stream; }
 	PipeStream &err() { return err_stream; }
 
    private:
 	pid_t pid;
+	int	  status = -1;
+	Pipe  in_pipe, out_pipe, err_pipe, pidfd, epoll;
 	PipeStream in_stream, out_stream, err_stream;
+
+	static int remaining(std::chrono::steady_clock::time_point deadline) {
+		if (deadline == std::chrono::steady_clock::time_point::max()) return -1;
+		auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		return std::max<int>(0, left.count());
+	}
+
+	void watch(int fd, std::uint32_t events) {
+		epoll_event event{};
+		event.events  = events;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) == -1)
+			throw std::runtime_error(std::string("epoll_ctl failed: ") + strerror(errno));
+	}
+
+	void reap(int options) {
+		int result;
+		while ((result = waitpid(pid, &status, options)) == -1 && errno == EINTR)
+			;
+		if (result == pid) pid = -1;
+	}
+
+	/**
+	 * @brief reads everything available on a non-blocking pipe into its stream
+	 *
+	 * @return false once the other end is closed
+	 */
+	static bool drain(Pipe &pipe, PipeStream &stream) {
+		char buffer[BUFFER_SIZE];
+		while (true) {
+			ssize_t bytes_read = read(pipe, buffer, sizeof(buffer));
+			if (bytes_read > 0) stream.feed(std::string_view(buffer, bytes_read));
+			else if (bytes_read == 0) return false;
+			else if (errno == EAGAIN) return true;
+			else if (errno != EINTR) throw std::runtime_error(std::string("failed to read from pipe: ") + strerror(errno));
+		}
+	}
+
+	/**
+	 * @brief handles the events that arrive within timeout milliseconds
+	 *
+	 * @return false if nothing happened
+	 */
+	bool pump(int timeout) {
+		// without a pidfd the exit of the child is noticed by polling
+		if (pidfd == -1 && pid != -1) {
+			reap(WNOHANG);
+			if (pid == -1) return true;
+			if (timeout < 0 || timeout > 10) timeout = 10;
+		}
+
+		epoll_event events[4];
+		int			count = epoll_wait(epoll, events, 4, timeout);
+		if (count == -1) {
+			if (errno == EINTR) return true;
+			throw std::runtime_error(std::string("epoll_wait failed: ") + strerror(errno));
+		}
+		for (int i = 0; i < count; i++) {
+			int fd = events[i].data.fd;
+			if (fd == pidfd) {
+				reap(0);
+				epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+			} else {
+				auto &stream = fd == out_pipe ? out_stream : err_stream;
+				if (!drain(fd == out_pipe ? out_pipe : err_pipe, stream)) epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+			}
+		}
+		return count > 0 || (pidfd == -1 && pid != -1);
+	}
+
+	std::string readSome(PipeStream &stream, Pipe &pipe, std::chrono::milliseconds timeout) {
+		auto deadline = std::chrono::steady_clock::now() + timeout;
+		drain(pipe, stream);
+		std::string result = stream.takeBuffered();
+		while (result.empty() && remaining(deadline) > 0 && pump(remaining(deadline)))
+			result = stream.takeBuffered();
+		return result;
+	}
 };
 
 class ShellProcess : public Process {
 public:
 	ShellProcess(const char *cmd) : Process("/bin/sh", "-c", cmd) {}
 };
-
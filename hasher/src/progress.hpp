@@ -8,48 +8,86 @@
 #include <visitors.hpp>
 #include <chrono>
 
+/**
+ * @brief Shows the progress of a HashStreamWriter. The hashing thread only queues what it reports, the line is drawn
+ * by the thread of a QueuedObserver at most every redrawInterval and once more when the viewer is destroyed.
+ */
 class ProgressViewer : public Observer<std::filesystem::path>, public Observer<std::uintmax_t> {
-	std::filesystem::path							   current_path;
-	std::uintmax_t									   current_bytes;
-	std::uintmax_t									   current_file_bytes;
-	std::uintmax_t									   total_bytes;
-	std::chrono::time_point<std::chrono::steady_clock> start_time;
-	std::ostream									  &os;
+	static constexpr auto redrawInterval = std::chrono::milliseconds(100);
+
+	struct Event {
+		std::filesystem::path path;		// the next file, empty for the bytes read of the current one
+		std::uintmax_t		  bytes = 0;
+	};
+
+	class Display : public Observer<Event> {
+		std::filesystem::path							   current_path;
+		std::uintmax_t									   current_bytes	  = 0;
+		std::uintmax_t									   current_file_bytes = 0;
+		std::uintmax_t									   total_bytes;
+		std::chrono::time_point<std::chrono::steady_clock> start_time;
+		std::chrono::time_point<std::chrono::steady_clock> drawn;
+		std::ostream									  &os;
+
+	   public:
+		Display(std::uintmax_t total_bytes, std::ostream &os)
+			: total_bytes(total_bytes), start_time(std::chrono::steady_clock::now()), drawn(start_time), os(os) {}
+
+		void update(const Event &event) override {
+			if (!event.path.empty()) {
+				current_bytes += current_file_bytes;
+				current_file_bytes = 0;
+				current_path	   = event.path;
+			} else current_file_bytes = event.bytes;
+			if (std::chrono::steady_clock::now() - drawn >= redrawInterval) redraw();
+		}
+
+		void redraw() {
+			auto now	 = std::chrono::steady_clock::now();
+			auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
+			drawn		 = now;
+
+			auto curr_bytes = current_bytes + current_file_bytes;
+			// streams have no known size, so the total can be exceeded
+			auto left		= curr_bytes < total_bytes ? total_bytes - curr_bytes : 0;
+			auto eta		= std::chrono::milliseconds(left * elapsed / (curr_bytes + 1));
+			auto percent	= total_bytes ? std::min<std::uintmax_t>(current_bytes * 100 / total_bytes, 100) : 0;
+
+			os << std::format("\rProcessing file {:30} | Total {}/{} byte(s) ({}%) | Est. {:%T}                   ",
+							  current_path.string(), curr_bytes, total_bytes, percent, eta)
+			   << std::flush;
+		}
+
+		void endLine() { os << std::endl; }
+	};
+
+	HashStreamWriter					   *writer;
+	Display								display;
+	std::unique_ptr<QueuedObserver<Event>> queued;
 
    public:
+	/**
+	 * @param writer notifies from the one thread that visits the tree
+	 * @param os where the line is drawn, not the stream of a report that follows
+	 */
 	ProgressViewer(FSNode *tree, HashStreamWriter *writer, std::ostream &os)
-		: current_bytes(0),
-		  current_file_bytes(0),
-		  total_bytes(tree->size),
-		  start_time(std::chrono::steady_clock::now()),
-		  os(os) {
-		writer->BasicObservable<std::filesystem::path>::addObserver(this);
+		: writer(writer), display(tree->size, os), queued(std::make_unique<QueuedObserver<Event>>(display)) {
+		writer->ProgressObservable<std::filesystem::path>::addObserver(this);
 		writer->ForwardObservable<std::uintmax_t>::addObserver(this);
 	}
-
-	void update(const std::filesystem::path &path) override {
-		current_bytes += current_file_bytes;
-		current_file_bytes = 0;
-		current_path	   = path;
-		redraw();
+	ProgressViewer(const ProgressViewer &)			  = delete;
+	ProgressViewer &operator=(const ProgressViewer &) = delete;
+	~ProgressViewer() override {
+		writer->ProgressObservable<std::filesystem::path>::removeObserver(this);
+		writer->ForwardObservable<std::uintmax_t>::removeObserver(this);
+		queued.reset();	   // delivers what is left
+		display.redraw();
+		display.endLine();
 	}
 
-	void update(const std::uintmax_t &bytes) override {
-		current_file_bytes = bytes;
-		redraw();
-	}
+	void update(const std::filesystem::path &path) override { queued->update(Event{path}); }
 
-	void redraw() {
-		auto now	 = std::chrono::steady_clock::now();
-		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
-
-		auto curr_bytes = current_bytes + current_file_bytes;
-		auto eta		= std::chrono::milliseconds((total_bytes - curr_bytes) * elapsed / (curr_bytes + 1));
-
-		std::cout << std::format("\rProcessing file {:30} | Total {}/{} byte(s) ({}%) | Est. {:%T}                   ",
-								 current_path.string(), curr_bytes, total_bytes, current_bytes * 100 / total_bytes, eta)
-				  << std::flush;
-	}
+	void update(const std::uintmax_t &bytes) override { queued->update(Event{{}, bytes}); }
 };
 
 inline void executeHashStreamWriter(FSNode &tree, HashStreamWriter &writer, std::ostream &os) {
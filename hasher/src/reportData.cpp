@@ -1,33 +1,50 @@
 #include <reportData.hpp>
 
-void compare(const ReportData &lhs, const ReportData &rhs, std::ostream &os) {
-	const char *OK		 = "OK       ";
-	const char *DELETED	 = "DELETED  ";
-	const char *NEW		 = "NEW      ";
-	const char *MODIFIED = "MODIFIED ";
-
+void compare(const ReportData &lhs, const ReportData &rhs, DiffReporter &report) {
 	auto l = lhs.begin();
 	auto r = rhs.begin();
 	while (l != lhs.end() && r != rhs.end()) {
+		if (l->directory || r->directory) {
+			if (l->path == r->path) {
+				if (l->directory && r->directory && l->checksum == r->checksum) {
+					auto		   dir	 = l->path;
+					std::uintmax_t files = 0;
+					for (; l != lhs.end() && isWithin(l->path, dir); ++l)
+						files += !l->directory;
+					while (r != rhs.end() && isWithin(r->path, dir)) ++r;
+					report.add(DiffStatus::Ok, dir, true, files);
+					continue;
+				}
+				// differing directories are described by their contents
+				if (l->directory) ++l;
+				if (r->directory) ++r;
+				continue;
+			}
+			if (l->directory && l->path < r->path) {
+				++l;
+				continue;
+			}
+			if (r->directory && r->path < l->path) {
+				++r;
+				continue;
+			}
+		}
 		if (l->path < r->path) {
-			os << DELETED << l->path << std::endl;
+			report.add(DiffStatus::Deleted, l->path);
 			++l;
 		} else if (r->path < l->path) {
-			os << NEW << r->path << std::endl;
+			report.add(DiffStatus::New, r->path);
 			++r;
 		} else {
-			if (l->checksum != r->checksum) { os << MODIFIED << l->path << std::endl; }
-			else { os << OK << l->path << std::endl; }
+			report.add(l->checksum != r->checksum ? DiffStatus::Modified : DiffStatus::Ok, l->path);
 			++l;
 			++r;
 		}
 	}
-	while (l != lhs.end()) {
-		os << DELETED << l->path << std::endl;
-		++l;
+	for (; l != lhs.end(); ++l) {
+		if (!l->directory) report.add(DiffStatus::Deleted, l->path);
 	}
-	while (r != rhs.end()) {
-		os << NEW << r->path << std::endl;
-		++r;
+	for (; r != rhs.end(); ++r) {
+		if (!r->directory) report.add(DiffStatus::New, r->path);
 	}
 }
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <tuple>
+#include <vector>
 #include <FSTree.hpp>
 #include <nlohmann/json.hpp>
 #include <factory.hpp>
@@ -9,14 +15,41 @@ class FileData {
    public:
 	std::filesystem::path path;
 	std::string			  checksum;
+	bool				  directory = false;
 };
 
 using ReportData = std::vector<FileData>;
 
+/**
+ * @brief checks if path is inside of dir (or is dir itself)
+ */
+inline bool isWithin(const std::filesystem::path &path, const std::filesystem::path &dir) {
+	if (dir.empty() || dir == ".") return path.is_relative();
+	return std::mismatch(dir.begin(), dir.end(), path.begin(), path.end()).first == dir.end();
+}
+
 class ReportDataBuilder {
+   protected:
+	std::filesystem::path subtree;
+
+	/**
+	 * @brief whether the entry with this path is kept, paths that do not even start like the subtree are rejected
+	 * without parsing them
+	 */
+	bool wanted(std::string_view path) const {
+		if (subtree.empty() || subtree == ".") return true;
+		return path.starts_with(subtree.native()) && isWithin(std::filesystem::path(path), subtree);
+	}
+
    public:
 	virtual ReportData build(std::istream &) = 0;
 	virtual ~ReportDataBuilder()			 = default;
+
+	/**
+	 * @brief keeps only the entries at or below subtree, so that a subtree can be verified against the manifest of
+	 * the whole tree. Empty keeps everything.
+	 */
+	void setSubtree(const std::filesystem::path &subtree) { this->subtree = subtree; }
 };
 
 class GNUReportDataBuilder : public ReportDataBuilder {
@@ -25,14 +58,14 @@ class GNUReportDataBuilder : public ReportDataBuilder {
 		ReportData	data;
 		std::string line;
 		while (std::getline(is, line)) {
-			std::istringstream ss(line);
-			std::string		   checksum;
-			std::string		   path;
-			ss >> checksum;
-			while (std::isspace(ss.peek()) || ss.peek() == '*')
-				ss.ignore();
-			ss >> path;
-			data.push_back(FileData(path, checksum));
+			// "<checksum> *<path>", the path is the rest of the line
+			std::string_view text	  = line;
+			std::size_t		 end	  = std::min(text.find_first_of(" \t"), text.size());
+			std::string_view checksum = text.substr(0, end);
+			std::size_t		 start	  = std::min(text.find_first_not_of(" \t*", end), text.size());
+			std::string_view path	  = text.substr(start);
+			if (checksum.empty() || path.empty() || !wanted(path)) continue;
+			data.push_back(FileData(std::filesystem::path(path), std::string(checksum)));
 		}
 		return data;
 	}
@@ -45,7 +78,25 @@ class JSONReportDataBuilder : public ReportDataBuilder {
 		nlohmann::json j;
 		is >> j;
 		for (const auto &item : j) {
-			data.push_back(FileData(item["path"], item["checksum"]));
+			const auto &path = item["path"].get_ref<const std::string &>();
+			if (wanted(path)) data.push_back(FileData(path, item["checksum"]));
+		}
+		return data;
+	}
+};
+
+/**
+ * @brief reads the output of MerkleHashStreamWriter, lines whose path ends with '/' are directories
+ */
+class MerkleReportDataBuilder : public GNUReportDataBuilder {
+   public:
+	ReportData build(std::istream &is) override {
+		ReportData data = GNUReportDataBuilder::build(is);
+		for (auto &item : data) {
+			if (!item.path.has_filename()) {
+				item.path	   = item.path.parent_path();
+				item.directory = true;
+			}
 		}
 		return data;
 	}
@@ -56,6 +107,193 @@ using ReportDataBuilderFactory = Factory<ReportDataBuilder>;
 JOB(report_data_builder_factory_register, {
 	ReportDataBuilderFactory::instance().registerType<GNUReportDataBuilder>("gnu");
 	ReportDataBuilderFactory::instance().registerType<JSONReportDataBuilder>("json");
+	ReportDataBuilderFactory::instance().registerType<MerkleReportDataBuilder>("merkle");
+});
+
+/**
+ * @brief sorts by path, so that the contents of a directory follow right after it
+ */
+inline void sortReportData(ReportData &data) { std::ranges::sort(data, {}, &FileData::path); }
+
+enum class DiffStatus { Ok, Modified, Deleted, New };
+
+inline const char *diffLabel(DiffStatus status) {
+	static const char *labels[] = {"OK       ", "MODIFIED ", "DELETED  ", "NEW      "};
+	return labels[std::size_t(status)];
+}
+
+inline const char *diffName(DiffStatus status) {
+	static const char *names[] = {"ok", "modified", "deleted", "new"};
+	return names[std::size_t(status)];
+}
+
+/**
+ * @brief Receives the result of compare() entry by entry. Every entry is counted, only the ones with a listed status
+ * are passed on to report(), so that skipped entries cost nothing but the count. finish() is called after the last
+ * entry.
+ */
+class DiffReporter {
+	friend class DiffRecorder;
+
+   public:
+	using Counts = std::array<std::uintmax_t, 4>;
+
+   protected:
+	Counts counts{};	 // files by status
+
+	/**
+	 * @param directory path is a directory whose contents are equal in both reports
+	 */
+	virtual void report(DiffStatus status, const std::filesystem::path &path, bool directory) = 0;
+
+   public:
+	virtual ~DiffReporter() = default;
+
+	/**
+	 * @param files how many files the entry counts for, an equal directory counts the files below it
+	 */
+	void add(DiffStatus status, const std::filesystem::path &path, bool directory = false, std::uintmax_t files = 1) {
+		counts[std::size_t(status)] += files;
+		if (lists(status)) report(status, path, directory);
+	}
+
+	virtual bool lists(DiffStatus) const { return true; }
+	virtual void finish() {}
+
+	const Counts &getCounts() const { return counts; }
+};
+
+/**
+ * @brief Keeps the listed entries of a comparison to pass them on later, for comparisons that run in parallel but are
+ * reported in order.
+ */
+class DiffRecorder : public DiffReporter {
+	const DiffReporter									 &target;
+	std::vector<std::tuple<DiffStatus, std::filesystem::path, bool>> entries;
+
+   protected:
+	void report(DiffStatus status, const std::filesystem::path &path, bool directory) override {
+		entries.emplace_back(status, path, directory);
+	}
+
+   public:
+	/**
+	 * @param target only the entries it lists are kept
+	 */
+	DiffRecorder(const DiffReporter &target) : target(target) {}
+
+	bool lists(DiffStatus status) const override { return target.lists(status); }
+
+	void replay(DiffReporter &reporter) const {
+		for (std::size_t i = 0; i < counts.size(); i++)
+			reporter.counts[i] += counts[i];
+		for (const auto &[status, path, directory] : entries)
+			reporter.report(status, path, directory);
+	}
+};
+
+/**
+ * @brief a line per entry: the status and the quoted path, directories end with '/'
+ */
+class LinesDiffReporter : public DiffReporter {
+	std::ostream &os;
+	bool		  ok;
+
+   protected:
+	void report(DiffStatus status, const std::filesystem::path &path, bool directory) override {
+		// no std::endl, flushing every line is what made large verifies slow
+		os << diffLabel(status) << (directory ? path / "" : path) << '\n';
+	}
+
+   public:
+	/**
+	 * @param ok whether files that did not change are listed too
+	 */
+	LinesDiffReporter(std::ostream &os, bool ok = true) : os(os), ok(ok) {}
+
+	bool lists(DiffStatus status) const override { return ok || status != DiffStatus::Ok; }
+	void finish() override { os.flush(); }
+};
+
+/**
+ * @brief lists only what changed
+ */
+class ChangesDiffReporter : public LinesDiffReporter {
+   public:
+	ChangesDiffReporter(std::ostream &os) : LinesDiffReporter(os, false) {}
+};
+
+/**
+ * @brief only the number of entries of every status
+ */
+class SummaryDiffReporter : public DiffReporter {
+	std::ostream &os;
+
+   protected:
+	void report(DiffStatus, const std::filesystem::path &, bool) override {}
+
+   public:
+	SummaryDiffReporter(std::ostream &os) : os(os) {}
+
+	bool lists(DiffStatus) const override { return false; }
+	void finish() override {
+		for (auto status : {DiffStatus::Ok, DiffStatus::Modified, DiffStatus::Deleted, DiffStatus::New})
+			os << diffLabel(status) << counts[std::size_t(status)] << '\n';
+		os.flush();
+	}
+};
+
+/**
+ * @brief For automation: {"changes": [{"status": ..., "path": ...}, ...], "summary": {"ok": n, ...}}. Files that
+ * did not change are only counted. The changes are streamed as they come.
+ */
+class JSONDiffReporter : public DiffReporter {
+	std::ostream &os;
+	bool		  first = true;
+
+   protected:
+	void report(DiffStatus status, const std::filesystem::path &path, bool) override {
+		os << (first ? "{\"changes\": [\n\t" : ",\n\t");
+		first = false;
+		os << nlohmann::json{{"status", diffName(status)}, {"path", path.string()}}.dump();
+	}
+
+   public:
+	JSONDiffReporter(std::ostream &os) : os(os) {}
+
+	bool lists(DiffStatus status) const override { return status != DiffStatus::Ok; }
+	void finish() override {
+		if (first) os << "{\"changes\": []";
+		else os << "\n]";
+		nlohmann::json summary = nlohmann::json::object();
+		for (auto status : {DiffStatus::Ok, DiffStatus::Modified, DiffStatus::Deleted, DiffStatus::New})
+			summary[diffName(status)] = counts[std::size_t(status)];
+		os << ", \"summary\": " << summary.dump() << "}\n";
+		os.flush();
+	}
+};
+
+using DiffReporterFactory = Factory<DiffReporter, std::ostream &>;
+
+JOB(diff_reporter_factory_register, {
+	DiffReporterFactory::instance().registerType<LinesDiffReporter>("all");
+	DiffReporterFactory::instance().registerType<ChangesDiffReporter>("changes");
+	DiffReporterFactory::instance().registerType<SummaryDiffReporter>("summary");
+	DiffReporterFactory::instance().registerType<JSONDiffReporter>("json");
 });
 
-void compare(const ReportData &lhs, const ReportData &rhs, std::ostream &os);
+/**
+ * @brief passes the differences between two sorted reports to report. Directories with equal checksums in both
+ * reports are reported once, without comparing their contents, and count as the files below them. finish() is left
+ * to the caller.
+ */
+void compare(const ReportData &lhs, const ReportData &rhs, DiffReporter &report);
+
+/**
+ * @brief prints the differences between two sorted reports, a line per entry
+ */
+inline void compare(const ReportData &lhs, const ReportData &rhs, std::ostream &os) {
+	LinesDiffReporter report(os);
+	compare(lhs, rhs, report);
+	report.finish();
+}
@@ -0,0 +1,454 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <FSTree.hpp>
+#include <calculators.hpp>
+#include <factory.hpp>
+#include <numa.hpp>
+#include <timing.hpp>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+/**
+ * @brief decides the order in which the files of a tree are hashed
+ */
+class SchedulingPolicy {
+   public:
+	/**
+	 * @param files the files in traversal order
+	 * @return indices into files in the order they should be hashed
+	 */
+	virtual std::vector<std::size_t> order(const std::vector<const File *> &files) const = 0;
+	virtual ~SchedulingPolicy()															 = default;
+
+   protected:
+	static std::vector<std::size_t> traversalOrder(const std::vector<const File *> &files) {
+		std::vector<std::size_t> order(files.size());
+		for (std::size_t i = 0; i < order.size(); i++)
+			order[i] = i;
+		return order;
+	}
+};
+
+class DepthFirstPolicy : public SchedulingPolicy {
+   public:
+	std::vector<std::size_t> order(const std::vector<const File *> &files) const override {
+		return traversalOrder(files);
+	}
+};
+
+/**
+ * @brief hashes the biggest files first, so that a single big file does not finish long after everything else
+ */
+class LargestFirstPolicy : public SchedulingPolicy {
+   public:
+	std::vector<std::size_t> order(const std::vector<const File *> &files) const override {
+		auto order = traversalOrder(files);
+		std::ranges::stable_sort(order, std::greater{}, [&](std::size_t i) { return files[i]->size; });
+		return order;
+	}
+};
+
+/**
+ * @brief hashes the smallest files first, so that most results are available early
+ */
+class SmallestFirstPolicy : public SchedulingPolicy {
+   public:
+	std::vector<std::size_t> order(const std::vector<const File *> &files) const override {
+		auto order = traversalOrder(files);
+		std::ranges::stable_sort(order, std::less{}, [&](std::size_t i) { return files[i]->size; });
+		return order;
+	}
+};
+
+using SchedulingPolicyFactory = Factory<SchedulingPolicy>;
+
+JOB(scheduling_policy_factory_register, {
+	SchedulingPolicyFactory::instance().registerType<DepthFirstPolicy>("depth-first");
+	SchedulingPolicyFactory::instance().registerType<LargestFirstPolicy>("largest-first");
+	SchedulingPolicyFactory::instance().registerType<SmallestFirstPolicy>("smallest-first");
+});
+
+class FileCollector : public FSVisitor {
+	std::vector<const File *> &files;
+
+   public:
+	FileCollector(std::vector<const File *> &files) : files(files) {}
+
+	void visit(const File &node) const override { files.push_back(&node); }
+	void visit(const Directory &node) const override {
+		for (auto &child : node.children) {
+			child->accept(*this);
+		}
+	}
+};
+
+/**
+ * @brief How many files of one device are hashed at the same time. Unless set explicitly the limit is guessed from
+ * sysfs: 2 for rotating disks, 32 for NVMe, 8 for other block devices. File systems without a block device (tmpfs,
+ * network file systems) are not limited.
+ */
+class DeviceLimits {
+	std::map<dev_t, unsigned> limits;
+	std::optional<unsigned>	  all;
+
+   public:
+	static constexpr unsigned unlimited = std::numeric_limits<unsigned>::max();
+
+	/**
+	 * @brief sets the limit for the device path is on
+	 */
+	void set(const std::filesystem::path &path, unsigned limit) {
+		struct stat st;
+		if (stat(path.c_str(), &st) == -1)
+			throw std::runtime_error("failed to stat " + path.string() + ": " + strerror(errno));
+		set(st.st_dev, limit);
+	}
+	void set(dev_t device, unsigned limit) { limits[device] = std::max(1u, limit); }
+	/**
+	 * @brief sets the limit of all devices without one of their own
+	 */
+	void setDefault(unsigned limit) { all = std::max(1u, limit); }
+
+	unsigned limit(dev_t device) const {
+		if (auto it = limits.find(device); it != limits.end()) return it->second;
+		if (all) return *all;
+		return detect(device);
+	}
+
+	static unsigned detect(dev_t device) {
+		namespace fs = std::filesystem;
+		std::error_code ec;
+		// partitions have no queue of their own, it is in the parent directory of the whole disk
+		fs::path block = fs::canonical("/sys/dev/block/" + std::to_string(major(device)) + ":" +
+										   std::to_string(minor(device)),
+									   ec);
+		if (ec) return unlimited;
+		if (!fs::exists(block / "queue") && fs::exists(block.parent_path() / "queue")) block = block.parent_path();
+
+		int			  rotational = -1;
+		std::ifstream is(block / "queue" / "rotational");
+		if (!(is >> rotational)) return unlimited;
+		if (rotational) return 2;
+		if (block.filename().string().starts_with("nvme")) return 32;
+		return 8;
+	}
+};
+
+/**
+ * @brief Hashes all files of a tree on a pool of worker threads, in the order chosen by a SchedulingPolicy. Every
+ * worker has its own calculator. Finished checksums wait in a reorder buffer until take() hands them out, so writers
+ * still visit the tree and produce output in their usual order.
+ *
+ * The reorder buffer is limited to bufferLimit bytes. When it is full workers wait, unless the file the writer is
+ * waiting for has not been started yet, in which case it is hashed next regardless of the policy.
+ *
+ * Calculators that are BatchChecksumCalculators get small files that are next in line in batches of their batchSize().
+ *
+ * Every device has its own queue and at most DeviceLimits::limit of its files are hashed at once, so that a slow disk
+ * does not take all workers while files on another device wait. Workers take the file ranked first by the policy
+ * among the devices that are below their limit.
+ *
+ * On machines with several NUMA nodes the workers are spread over the nodes and pinned to them. A worker prefers the
+ * devices of its own node (NumaTopology::deviceNode) and only takes files of other nodes when its own have none, and
+ * its read buffers are allocated and reused on its node (BlockPool).
+ */
+class HashScheduler {
+	enum class State : std::uint8_t { Pending, Running, Done, Taken };
+
+	struct Result {
+		HashResult		   hash;
+		std::exception_ptr error;
+	};
+
+	static constexpr std::size_t nodeOverhead = 32;	   // approximate bookkeeping of a node of the buffer's map
+
+	/**
+	 * @brief approximate memory a result takes in the reorder buffer, with the heap parts of its checksum and path
+	 */
+	static std::size_t charge(const Result &result) {
+		return sizeof(std::pair<const std::size_t, Result>) + nodeOverhead + result.hash.checksum.capacity() +
+			   result.hash.timing.path.native().capacity();
+	}
+	static constexpr std::uintmax_t batchFileLimit = 64 << 10;	  // larger files are not batched
+
+	struct Device {
+		std::vector<std::size_t> queue;		  // indices of the device's files in the order of the policy
+		std::size_t				 next = 0;	  // position in queue of the next file to hash
+		unsigned				 limit;
+		unsigned				 running = 0;
+		int						 node	 = -1;	  // NUMA node closest to the device, -1 if unknown
+	};
+
+	std::vector<const File *>					  files;
+	std::unordered_map<const File *, std::size_t> indices;
+	std::vector<std::size_t>					  ranks;		// position of every file in the order of the policy
+	std::vector<Device>							  devices;
+	std::vector<std::size_t>					  deviceOf;		// index into devices for every file
+	std::vector<State>							  states;
+	std::unordered_map<std::size_t, Result>		  buffer;
+	std::size_t									  buffered = 0;
+	std::size_t									  bufferLimit;
+	std::optional<std::size_t>					  wanted;	  // the file take() is waiting for
+	bool										  stopped = false;
+
+	std::mutex							m;
+	std::condition_variable				finished;
+	std::condition_variable				space;
+	std::vector<std::thread>			workers;
+	std::unique_ptr<ChecksumCalculator>	own;	 // hashes in take() when there are no workers
+
+	bool hasRoom(const Device &device) const { return device.running < device.limit; }
+
+	bool wantedIsReady() const {
+		return wanted && states[*wanted] == State::Pending && hasRoom(devices[deviceOf[*wanted]]);
+	}
+
+	/**
+	 * @param node of the worker, -1 for any
+	 * @return the device whose next pending file ranks first among the devices with room, those of node or of an
+	 * unknown node first, nullptr if there is none
+	 */
+	Device *bestDevice(int node) {
+		Device *best = nullptr, *bestLocal = nullptr;
+		auto	before = [&](Device &device, Device *other) {
+			   return !other || ranks[device.queue[device.next]] < ranks[other->queue[other->next]];
+		};
+		for (auto &device : devices) {
+			while (device.next < device.queue.size() && states[device.queue[device.next]] != State::Pending)
+				++device.next;
+			if (device.next == device.queue.size() || !hasRoom(device)) continue;
+			if (before(device, best)) best = &device;
+			if ((node < 0 || device.node < 0 || device.node == node) && before(device, bestLocal)) bestLocal = &device;
+		}
+		return bestLocal ? bestLocal : best;
+	}
+
+	bool allStarted() {
+		for (auto &device : devices) {
+			while (device.next < device.queue.size() && states[device.queue[device.next]] != State::Pending)
+				++device.next;
+			if (device.next < device.queue.size()) return false;
+		}
+		return true;
+	}
+
+	std::size_t start(std::size_t index) {
+		states[index] = State::Running;
+		devices[deviceOf[index]].running++;
+		return index;
+	}
+
+	std::optional<std::size_t> nextIndex(std::unique_lock<std::mutex> &lock, int node) {
+		Device *best = nullptr;
+		space.wait(lock, [&] {
+			if (stopped || allStarted()) return true;
+			if (buffered < bufferLimit && (best = bestDevice(node))) return true;
+			return wantedIsReady();
+		});
+		if (stopped || allStarted()) return std::nullopt;
+
+		if (best) return start(best->queue[best->next++]);
+		return start(*wanted);
+	}
+
+	bool batchable(std::size_t index) const {
+		return files[index]->size <= batchFileLimit && dynamic_cast<const RegularFile *>(files[index]);
+	}
+
+	/**
+	 * @brief adds the small files that are next in line on the device of a batch that starts with a small file. The
+	 * batch is read by one thread, one file after the other, so it takes a single slot of the device.
+	 */
+	void extendBatch(std::vector<std::size_t> &batch, std::size_t size) {
+		if (!batchable(batch.front())) return;
+		Device &device = devices[deviceOf[batch.front()]];
+		while (batch.size() < size && buffered < bufferLimit) {
+			while (device.next < device.queue.size() && states[device.queue[device.next]] != State::Pending)
+				++device.next;
+			if (device.next == device.queue.size() || !batchable(device.queue[device.next])) break;
+			states[device.queue[device.next]] = State::Running;
+			batch.push_back(device.queue[device.next++]);
+		}
+	}
+
+	/**
+	 * @brief reads the whole files and hashes them with one call
+	 */
+	std::vector<Result> hashBatch(BatchChecksumCalculator &calc, const std::vector<std::size_t> &batch) {
+		std::vector<Result>			  results(batch.size());
+		std::vector<std::string>	  contents(batch.size());
+		std::vector<std::string_view> inputs;
+		std::vector<std::size_t>	  read;
+		for (std::size_t i = 0; i < batch.size(); i++) {
+			const File &file = *files[batch[i]];
+			try {
+				auto start			= std::chrono::steady_clock::now();
+				auto stream			= file.getStream();
+				auto opened			= std::chrono::steady_clock::now();
+				contents[i].resize(file.size);
+				contents[i].resize(stream->rdbuf()->sgetn(contents[i].data(), file.size));
+				if (stream->rdbuf()->sgetc() != std::char_traits<char>::eof())	   // grew since the scan
+					contents[i] += getString(*stream);
+				results[i].hash.timing = {file.path, file.size, opened - start, std::chrono::steady_clock::now() - opened};
+				inputs.push_back(contents[i]);
+				read.push_back(i);
+			} catch (...) { results[i].error = std::current_exception(); }
+		}
+		if (inputs.empty()) return results;
+
+		auto start	   = std::chrono::steady_clock::now();
+		auto checksums = calc.calculate(inputs);
+		auto digest	   = (std::chrono::steady_clock::now() - start) / inputs.size();
+		for (std::size_t j = 0; j < read.size(); j++) {
+			results[read[j]].hash.checksum		= std::move(checksums[j]);
+			results[read[j]].hash.timing.digest = digest;
+		}
+		return results;
+	}
+
+	/**
+	 * @brief hashes a started file, with the files batched with it, and buffers the results. The lock is released
+	 * while hashing.
+	 */
+	void hash(std::unique_lock<std::mutex> &lock, ChecksumCalculator &calc, std::size_t index) {
+		auto					*batchCalc = dynamic_cast<BatchChecksumCalculator *>(&calc);
+		std::vector<std::size_t> batch	   = {index};
+		if (batchCalc) extendBatch(batch, batchCalc->batchSize());
+		lock.unlock();
+		std::vector<Result> results(1);
+		if (batch.size() > 1) results = hashBatch(*batchCalc, batch);
+		else try {
+				results[0].hash = hashFile(calc, *files[index]);
+			} catch (...) { results[0].error = std::current_exception(); }
+		lock.lock();
+
+		for (std::size_t i = 0; i < batch.size(); i++) {
+			buffered += charge(results[i]);
+			buffer.emplace(batch[i], std::move(results[i]));
+			states[batch[i]] = State::Done;
+		}
+		devices[deviceOf[batch.front()]].running--;
+		finished.notify_all();
+		space.notify_all();
+	}
+
+	/**
+	 * @param node NUMA node the worker is pinned to, nullptr for none
+	 */
+	void work(std::unique_ptr<ChecksumCalculator> calc, const NumaTopology::Node *node) {
+		// pinned before the calculator and the read buffers of the worker touch their memory
+		if (node && !NumaTopology::pin(node->cpus)) node = nullptr;
+		std::unique_lock lock(m);
+		while (auto index = nextIndex(lock, node ? node->id : -1))
+			hash(lock, *calc, *index);
+	}
+
+   public:
+	/**
+	 * @param workerCount threads that hash files, with 0 take() hashes the files on the calling thread. That is how a
+	 * BatchChecksumCalculator gets several files at once without any threads.
+	 * @param numa the topology to place the workers on, nullptr leaves them to the operating system
+	 */
+	HashScheduler(const FSNode &tree, const std::string &algorithm, const SchedulingPolicy &policy,
+				  std::size_t workerCount, std::size_t bufferLimit = 64 << 20, const DeviceLimits &limits = {},
+				  const NumaTopology *numa = &NumaTopology::system())
+		: bufferLimit(bufferLimit) {
+		tree.accept(FileCollector(files));
+		for (std::size_t i = 0; i < files.size(); i++)
+			indices[files[i]] = i;
+		states.resize(files.size(), State::Pending);
+
+		// with a single node or a single worker there is nothing to place
+		workerCount = std::min(workerCount, files.size());
+		if (numa && (numa->getNodes().size() < 2 || workerCount < 2)) numa = nullptr;
+
+		auto order = policy.order(files);
+		ranks.resize(files.size());
+		deviceOf.resize(files.size());
+		std::map<dev_t, std::size_t> slots;
+		for (std::size_t rank = 0; rank < order.size(); rank++) {
+			std::size_t index = order[rank];
+			dev_t		dev	  = files[index]->device;
+			auto [it, added]  = slots.try_emplace(dev, devices.size());
+			if (added) devices.push_back(Device{.limit = limits.limit(dev), .node = numa ? numa->deviceNode(dev) : -1});
+			devices[it->second].queue.push_back(index);
+			deviceOf[index] = it->second;
+			ranks[index]	= rank;
+		}
+
+		if (!workerCount) own = ChecksumCalculatorFactory::instance().create(algorithm);
+		for (std::size_t i = 0; i < workerCount; i++) {
+			const NumaTopology::Node *node = numa ? &numa->getNodes()[i % numa->getNodes().size()] : nullptr;
+			workers.emplace_back(&HashScheduler::work, this, ChecksumCalculatorFactory::instance().create(algorithm),
+								 node);
+		}
+	}
+
+	HashScheduler(const HashScheduler &)			= delete;
+	HashScheduler &operator=(const HashScheduler &) = delete;
+
+	~HashScheduler() {
+		{
+			std::lock_guard lock(m);
+			stopped = true;
+		}
+		space.notify_all();
+		for (auto &worker : workers)
+			worker.join();
+	}
+
+	/**
+	 * @brief waits for the checksum of file, every file can be taken once
+	 */
+	HashResult take(const File &file) {
+		auto it = indices.find(&file);
+		if (it == indices.end()) throw std::logic_error("file is not scheduled: " + file.path.string());
+		std::size_t index = it->second;
+
+		std::unique_lock lock(m);
+		if (states[index] == State::Taken) throw std::logic_error("file was already taken: " + file.path.string());
+		if (own) {
+			// files batched with an earlier one are done already
+			if (states[index] == State::Pending) hash(lock, *own, start(index));
+		} else {
+			wanted = index;
+			space.notify_all();
+			finished.wait(lock, [&] { return states[index] == State::Done; });
+			wanted.reset();
+		}
+
+		auto   node	  = buffer.extract(index);
+		Result result = std::move(node.mapped());
+		states[index] = State::Taken;
+		buffered -= charge(result);
+		lock.unlock();
+		space.notify_all();
+
+		if (result.error) std::rethrow_exception(result.error);
+		return std::move(result.hash);
+	}
+
+	std::size_t						 fileCount() const { return files.size(); }
+	const std::vector<const File *> &getFiles() const { return files; }
+
+	/**
+	 * @brief bytes currently held by the reorder buffer
+	 */
+	std::size_t bufferedBytes() {
+		std::lock_guard lock(m);
+		return buffered;
+	}
+};
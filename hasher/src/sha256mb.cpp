@@ -0,0 +1,2 @@
+// registers "sha256_mb" with the ChecksumCalculatorFactory of every program
+#include <sha256mb.hpp>
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <calculators.hpp>
+
+/**
+ * @brief Multi-buffer SHA-256: every SIMD lane hashes a different message, one block per lane at a time. A lane that
+ * finishes its message takes the next one, so messages of different lengths keep all lanes busy.
+ *
+ * 16 lanes with AVX-512, 8 with AVX2, 4 otherwise (SSE2 on x86_64, plain scalar code where the compiler has no vector
+ * unit to use).
+ */
+class SHA256MultiBuffer {
+	static constexpr std::size_t maxLanes = 16;
+
+	using State = std::uint32_t[8][maxLanes];	  // word, lane
+
+	typedef std::uint32_t u32x4 __attribute__((vector_size(16)));
+	typedef std::uint32_t u32x8 __attribute__((vector_size(32)));
+	typedef std::uint32_t u32x16 __attribute__((vector_size(64)));
+
+	static constexpr std::uint32_t k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+	static constexpr std::uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+											0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+	/**
+	 * @brief one block for each of the lanes, the same code for every vector width. Inlined into the functions below,
+	 * which are compiled for their instruction set.
+	 */
+	template <class V, std::size_t lanes>
+	[[gnu::always_inline]] static inline void compressLanes(State &state, const unsigned char *const *blocks) {
+		V w[16];
+		for (std::size_t t = 0; t < 16; t++)
+			for (std::size_t i = 0; i < lanes; i++) {
+				std::uint32_t word;
+				std::memcpy(&word, blocks[i] + 4 * t, 4);
+				w[t][i] = __builtin_bswap32(word);
+			}
+
+		V s[8];
+		for (std::size_t j = 0; j < 8; j++)
+			std::memcpy(&s[j], state[j], sizeof(V));
+		V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+		for (std::size_t t = 0; t < 64; t++) {
+			V wt;
+			if (t < 16) wt = w[t];
+			else {
+				V w2  = w[(t - 2) & 15], w15 = w[(t - 15) & 15];
+				V s0  = (w15 >> 7 | w15 << 25) ^ (w15 >> 18 | w15 << 14) ^ (w15 >> 3);
+				V s1  = (w2 >> 17 | w2 << 15) ^ (w2 >> 19 | w2 << 13) ^ (w2 >> 10);
+				wt	  = s1 + w[(t - 7) & 15] + s0 + w[t & 15];
+				w[t & 15] = wt;
+			}
+			V t1 = h + ((e >> 6 | e << 26) ^ (e >> 11 | e << 21) ^ (e >> 25 | e << 7)) + ((e & f) ^ (~e & g)) + k[t] + wt;
+			V t2 = ((a >> 2 | a << 30) ^ (a >> 13 | a << 19) ^ (a >> 22 | a << 10)) + ((a & b) ^ (a & c) ^ (b & c));
+			h	 = g;
+			g	 = f;
+			f	 = e;
+			e	 = d + t1;
+			d	 = c;
+			c	 = b;
+			b	 = a;
+			a	 = t1 + t2;
+		}
+
+		s[0] += a, s[1] += b, s[2] += c, s[3] += d, s[4] += e, s[5] += f, s[6] += g, s[7] += h;
+		for (std::size_t j = 0; j < 8; j++)
+			std::memcpy(state[j], &s[j], sizeof(V));
+	}
+
+	static void compress4(State &state, const unsigned char *const *blocks) {
+		compressLanes<u32x4, 4>(state, blocks);
+	}
+#if defined(__x86_64__)
+	__attribute__((target("avx2"))) static void compress8(State &state, const unsigned char *const *blocks) {
+		compressLanes<u32x8, 8>(state, blocks);
+	}
+	__attribute__((target("avx512f"))) static void compress16(State &state, const unsigned char *const *blocks) {
+		compressLanes<u32x16, 16>(state, blocks);
+	}
+#endif
+
+	/**
+	 * @brief a message in a lane, its whole blocks are read in place and the padded tail from a copy
+	 */
+	struct Lane {
+		std::size_t			 message;
+		const unsigned char *data;
+		std::size_t			 blocks;	  // whole blocks of data left
+		std::size_t			 tailBlocks;	  // padded blocks left after them
+		alignas(16) unsigned char tail[128];
+		bool active = false;
+
+		void start(std::size_t index, std::string_view text) {
+			message			= index;
+			data			= reinterpret_cast<const unsigned char *>(text.data());
+			blocks			= text.size() / 64;
+			std::size_t rest = text.size() % 64;
+			tailBlocks		= rest + 9 <= 64 ? 1 : 2;
+			std::memset(tail, 0, sizeof(tail));
+			if (rest) std::memcpy(tail, data + blocks * 64, rest);
+			tail[rest]			= 0x80;
+			std::uint64_t bits	= std::uint64_t(text.size()) * 8;
+			unsigned char *end	= tail + tailBlocks * 64;
+			for (int i = 1; i <= 8; i++, bits >>= 8)
+				end[-i] = (unsigned char)bits;
+			active = true;
+		}
+
+		const unsigned char *block() const { return blocks ? data : tail; }
+
+		/**
+		 * @return whether the message is done
+		 */
+		bool advance() {
+			if (blocks) {
+				data += 64;
+				--blocks;
+				return false;
+			}
+			if (tailBlocks == 2) {
+				std::memmove(tail, tail + 64, 64);
+				tailBlocks = 1;
+				return false;
+			}
+			return true;
+		}
+	};
+
+   public:
+	using Digest = std::array<unsigned char, 32>;
+
+	/**
+	 * @return the number of lanes of the widest vector unit of this CPU
+	 */
+	static std::size_t lanes() {
+#if defined(__x86_64__)
+		static const std::size_t lanes = __builtin_cpu_supports("avx512f") ? 16
+										 : __builtin_cpu_supports("avx2")  ? 8
+																		   : 4;
+		return lanes;
+#else
+		return 4;
+#endif
+	}
+
+	/**
+	 * @param lanes 4, 8 or 16, at most lanes()
+	 */
+	static std::vector<Digest> hash(const std::vector<std::string_view> &messages,
+									std::size_t							 lanes = SHA256MultiBuffer::lanes()) {
+		void (*compress)(State &, const unsigned char *const *) = compress4;
+#if defined(__x86_64__)
+		if (lanes == 8) compress = compress8;
+		if (lanes == 16) compress = compress16;
+#endif
+		if (lanes != 4 && compress == compress4) lanes = 4;
+
+		static const unsigned char idle[64] = {};
+		alignas(64) State		   state;
+		std::vector<Lane>		   lane(lanes);
+		std::vector<Digest>		   digests(messages.size());
+		std::size_t				   next = 0;
+
+		auto assign = [&](std::size_t i) {
+			lane[i].active = false;
+			if (next == messages.size()) return;
+			lane[i].start(next, messages[next]);
+			next++;
+			for (std::size_t j = 0; j < 8; j++)
+				state[j][i] = iv[j];
+		};
+		for (std::size_t i = 0; i < lanes; i++)
+			assign(i);
+
+		const unsigned char *blocks[maxLanes];
+		while (std::ranges::any_of(lane, &Lane::active)) {
+			for (std::size_t i = 0; i < lanes; i++)
+				blocks[i] = lane[i].active ? lane[i].block() : idle;
+			compress(state, blocks);
+			for (std::size_t i = 0; i < lanes; i++) {
+				if (!lane[i].active || !lane[i].advance()) continue;
+				Digest &digest = digests[lane[i].message];
+				for (std::size_t j = 0; j < 8; j++)
+					for (std::size_t byte = 0; byte < 4; byte++)
+						digest[4 * j + byte] = (unsigned char)(state[j][i] >> (24 - 8 * byte));
+				assign(i);
+			}
+		}
+		return digests;
+	}
+};
+
+/**
+ * @brief Standard sha256 digests. Single streams are hashed by OpenSSL, batches of small files by SHA256MultiBuffer.
+ * Worth it on CPUs without the SHA extensions, with them OpenSSL alone is about as fast.
+ */
+class SHA256MultiBufferChecksumCalculator : public OpenSSLChecksumCalculator<EVP_sha256>,
+											 public BatchChecksumCalculator {
+   public:
+	std::size_t batchSize() const override { return SHA256MultiBuffer::lanes(); }
+
+	std::vector<std::string> calculate(const std::vector<std::string_view> &inputs) override {
+		std::vector<std::string> result;
+		result.reserve(inputs.size());
+		for (const auto &digest : SHA256MultiBuffer::hash(inputs))
+			result.push_back(toHex(digest.data(), digest.size()));
+		return result;
+	}
+
+	using OpenSSLChecksumCalculator<EVP_sha256>::calculate;
+};
+
+JOB(SHA256MultiBufferChecksumCalculator, {
+	ChecksumCalculatorFactory::instance().registerType<SHA256MultiBufferChecksumCalculator>("sha256_mb");
+});
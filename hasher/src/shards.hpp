@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <compression.hpp>
+#include <nlohmann/json.hpp>
+#include <reportData.hpp>
+#include <visitors.hpp>
+
+/**
+ * @brief Describes a manifest split into several files. Every file of the tree belongs to exactly one shard, chosen
+ * from its path below the root: either from its top-level directory, so that a subtree is in a single shard, or from
+ * the whole path, which spreads the files evenly. Shards are manifests of their own in the gnu or json format.
+ *
+ * The index is a json object: {"format": ..., "by": "directory" | "hash", "root": ..., "shards": [...]}, shard paths
+ * are relative to the index. Shards may be zstd compressed, the index never is.
+ */
+struct ShardIndex {
+	enum class Key { Directory, Hash };
+
+	std::string						   format = "gnu";
+	Key								   by	  = Key::Directory;
+	std::filesystem::path			   root;	 // path of the hashed root as written in the shards
+	std::vector<std::filesystem::path> shards;
+
+	/**
+	 * @brief FNV-1a, the same on every platform so that the shards can be found again
+	 */
+	static std::uint64_t hash(const std::string &text) {
+		std::uint64_t h = 0xcbf29ce484222325;
+		for (unsigned char c : text)
+			h = (h ^ c) * 0x100000001b3;
+		return h;
+	}
+
+	/**
+	 * @param path as written in the manifest
+	 */
+	std::size_t shardOf(const std::filesystem::path &path) const {
+		auto below = root.empty() ? path : path.lexically_relative(root);
+		if (below.empty() || *below.begin() == "..") below = path;
+		auto key = by == Key::Directory ? *below.begin() : below;
+		return hash(key.generic_string()) % shards.size();
+	}
+
+	/**
+	 * @return the shards that can have files at or below subtree, a path as written in the manifest
+	 */
+	std::vector<std::size_t> shardsFor(const std::filesystem::path &subtree) const {
+		auto below = root.empty() ? subtree : subtree.lexically_relative(root);
+		if (by == Key::Directory && !below.empty() && below != "." && *below.begin() != "..") return {shardOf(subtree)};
+		std::vector<std::size_t> all(shards.size());
+		for (std::size_t i = 0; i < all.size(); i++)
+			all[i] = i;
+		return all;
+	}
+
+	void save(const std::filesystem::path &path) const {
+		nlohmann::json j = {{"format", format},
+							{"by", by == Key::Directory ? "directory" : "hash"},
+							{"root", root.string()},
+							{"shards", nlohmann::json::array()}};
+		for (const auto &shard : shards)
+			j["shards"].push_back(shard.string());
+		std::ofstream ofs(path);
+		if (!ofs) throw std::runtime_error("failed to open file: " + path.string());
+		ofs << j.dump(1, '\t') << '\n';
+	}
+
+	static ShardIndex load(std::istream &is) {
+		ShardIndex index;
+		try {
+			nlohmann::json j;
+			is >> j;
+			index.format = j.at("format");
+			index.by	 = j.at("by") == "hash" ? Key::Hash : Key::Directory;
+			index.root	 = j.at("root").get<std::string>();
+			for (const auto &shard : j.at("shards"))
+				index.shards.push_back(shard.get<std::string>());
+		} catch (const nlohmann::json::exception &e) {
+			throw std::runtime_error(std::string("invalid shard index: ") + e.what());
+		}
+		if (index.shards.empty()) throw std::runtime_error("invalid shard index: no shards");
+		return index;
+	}
+
+	/**
+	 * @brief an index is a json object, manifests are lines or a json array
+	 */
+	static bool isIndex(std::istream &is) {
+		while (std::isspace(is.peek()))
+			is.ignore();
+		return is.peek() == '{';
+	}
+};
+
+/**
+ * @brief Writes a sharded manifest: one writer of the format per shard, each with its own file next to the index.
+ * The index is written when the writer is destroyed, after all shards are complete.
+ */
+class ShardedHashStreamWriter : public HashStreamWriter {
+	std::filesystem::path						   indexPath;
+	mutable ShardIndex							   index;
+	std::vector<std::unique_ptr<ManifestOStream>>  files;
+	std::vector<std::unique_ptr<HashStreamWriter>> writers;
+	mutable bool								   rootKnown = false;
+
+   public:
+	/**
+	 * @param indexPath shards are written to indexPath.0, indexPath.1, ...
+	 * @param format gnu or json, the merkle format needs the whole tree in one file
+	 * @param compress write the shards as indexPath.0.zst, ... compressed with zstd
+	 */
+	ShardedHashStreamWriter(ChecksumCalculator &calc, std::ostream &os, const std::filesystem::path &indexPath,
+							const std::string &format, std::size_t count, ShardIndex::Key by, bool compress = false)
+		: HashStreamWriter(calc, os), indexPath(indexPath) {
+		if (format != "gnu" && format != "json") throw std::runtime_error("sharding works with the gnu and json formats");
+		if (count == 0) throw std::runtime_error("at least one shard is needed");
+		index.format = format;
+		index.by	 = by;
+		for (std::size_t i = 0; i < count; i++) {
+			auto shard = indexPath;
+			shard += "." + std::to_string(i) + (compress ? ".zst" : "");
+			index.shards.push_back(shard.filename());
+			files.push_back(std::make_unique<ManifestOStream>(shard, compress));
+			writers.push_back(HashStreamWriterFactory::instance().create(format, calc, *files.back()));
+		}
+	}
+
+	~ShardedHashStreamWriter() {
+		writers.clear();	 // json writers write when destroyed
+		try {
+			for (auto &file : files)
+				file->close();
+			index.save(indexPath);
+		} catch (const std::exception &e) { std::cerr << "error: " << e.what() << std::endl; }
+	}
+
+	void visit(const Directory &node) const override {
+		if (!rootKnown) {
+			index.root = std::filesystem::relative(node.path);
+			rootKnown  = true;
+		}
+		HashStreamWriter::visit(node);
+	}
+
+	void writeFile(const File &node, const std::filesystem::path &relative, const std::string &checksum) const override {
+		writers[index.shardOf(relative)]->writeFile(node, relative, checksum);
+	}
+};
+
+/**
+ * @brief Compares a tree with a sharded manifest. Only the shards that can hold files at or below subtree are read,
+ * jobs of them at a time, each is compared with the files of the tree that belong to it. The differences are
+ * reported shard by shard, finish() is left to the caller.
+ *
+ * @param indexPath shards are looked up next to it
+ * @param current the files of the tree, with paths like the ones in the manifest. Moved into the shards, pass it with
+ * std::move so that the tree is not held twice
+ * @param subtree only files at or below it are compared, a path as written in the manifest, empty for everything
+ */
+inline void compareShards(const ShardIndex &index, const std::filesystem::path &indexPath, ReportData current,
+						  const std::filesystem::path &subtree, std::size_t jobs, DiffReporter &report) {
+	std::vector<ReportData> parts(index.shards.size());
+	for (auto &item : current)
+		parts[index.shardOf(item.path)].push_back(std::move(item));
+	ReportData().swap(current);
+
+	auto									   needed = index.shardsFor(subtree);
+	std::vector<std::unique_ptr<DiffRecorder>> results(needed.size());
+	std::vector<std::exception_ptr>			   errors(needed.size());
+	std::atomic<std::size_t>				   next = 0;
+
+	auto work = [&] {
+		for (std::size_t i; (i = next++) < needed.size();) {
+			try {
+				std::size_t	  shard = needed[i];
+				auto		  path	= indexPath.parent_path() / index.shards[shard];
+				ManifestIStream is(path);
+				auto builder = ReportDataBuilderFactory::instance().create(index.format);
+				builder->setSubtree(subtree);
+				ReportData old = builder->build(is);
+				sortReportData(old);
+				sortReportData(parts[shard]);
+				auto recorder = std::make_unique<DiffRecorder>(report);
+				compare(old, parts[shard], *recorder);
+				ReportData().swap(parts[shard]);	 // only the recorded differences are kept
+				results[i] = std::move(recorder);
+			} catch (...) { errors[i] = std::current_exception(); }
+		}
+	};
+	std::vector<std::thread> threads;
+	for (std::size_t i = 1; i < std::min(std::max<std::size_t>(jobs, 1), needed.size()); i++)
+		threads.emplace_back(work);
+	work();
+	for (auto &thread : threads)
+		thread.join();
+
+	for (std::size_t i = 0; i < needed.size(); i++) {
+		if (errors[i]) std::rethrow_exception(errors[i]);
+		results[i]->replay(report);
+	}
+}
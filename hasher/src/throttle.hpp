@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <linux/ioprio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * @brief Token bucket that allows going into debt: taking more tokens than available is allowed, the caller is told
+ * how long to wait until the debt is paid off.
+ */
+class TokenBucket {
+	double								  rate	 = 0;	  // tokens per second, 0 is unlimited
+	double								  burst	 = 0;
+	double								  tokens = 0;
+	std::chrono::steady_clock::time_point last;
+
+   public:
+	using clock = std::chrono::steady_clock;
+
+	TokenBucket() = default;
+	TokenBucket(double rate, double burst, clock::time_point now = clock::now())
+		: rate(rate), burst(burst), tokens(burst), last(now) {}
+
+	bool limited() const { return rate > 0; }
+
+	void setRate(double rate) { this->rate = rate; }
+	double getRate() const { return rate; }
+
+	/**
+	 * @return how long to wait before the taken tokens are paid for
+	 */
+	std::chrono::nanoseconds take(double count, clock::time_point now = clock::now()) {
+		if (!limited()) return {};
+		tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+		last   = now;
+		tokens -= count;
+		if (tokens >= 0) return {};
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(-tokens / rate));
+	}
+};
+
+/**
+ * @brief Process-wide limit on read bandwidth and read operations, applied by FileBuffer to every read.
+ *
+ * In adaptive mode the limits are scaled down when the recent read latency rises well above its long-term average
+ * and slowly restored when it falls back (AIMD), so that hashing yields to other users of the disk.
+ */
+class IOThrottle {
+	std::mutex		  m;
+	std::atomic<bool> active = false;
+	TokenBucket		  bytes, ops;
+	double			  maxBytesRate = 0, maxOpsRate = 0;
+
+	bool								  adaptive = false;
+	double								  factor   = 1;		  // current share of the configured limits
+	double								  shortLatency = 0, longLatency = 0;	 // averages in microseconds
+	std::chrono::steady_clock::time_point lastAdjustment;
+
+	static constexpr double minFactor = 1.0 / 64;
+
+	void adjust(std::chrono::steady_clock::time_point now) {
+		if (now - lastAdjustment < std::chrono::milliseconds(100)) return;
+		lastAdjustment = now;
+		if (shortLatency > 2 * longLatency) factor = std::max(minFactor, factor * 0.5);
+		else factor = std::min(1.0, factor + 0.05);
+		bytes.setRate(maxBytesRate * factor);
+		ops.setRate(maxOpsRate * factor);
+	}
+
+   public:
+	static IOThrottle &instance() {
+		static IOThrottle instance;
+		return instance;
+	}
+
+	/**
+	 * @param bytesPerSecond 0 for no limit
+	 * @param opsPerSecond 0 for no limit
+	 */
+	void configure(double bytesPerSecond, double opsPerSecond, bool adaptive) {
+		std::lock_guard lock(m);
+		maxBytesRate   = bytesPerSecond;
+		maxOpsRate	   = opsPerSecond;
+		bytes		   = TokenBucket(bytesPerSecond, bytesPerSecond / 10);	  // bursts of up to 100ms
+		ops			   = TokenBucket(opsPerSecond, std::max(1.0, opsPerSecond / 10));
+		this->adaptive = adaptive;
+		factor		   = 1;
+		active		   = bytesPerSecond > 0 || opsPerSecond > 0;
+	}
+
+	bool enabled() const { return active.load(std::memory_order_relaxed); }
+
+	double currentFactor() {
+		std::lock_guard lock(m);
+		return factor;
+	}
+
+	/**
+	 * @brief accounts for a finished read and sleeps if the limits were exceeded
+	 */
+	void completed(std::size_t count, std::chrono::nanoseconds latency) {
+		std::chrono::nanoseconds wait;
+		{
+			std::lock_guard lock(m);
+			auto			now = std::chrono::steady_clock::now();
+			if (adaptive) {
+				double us = std::chrono::duration<double, std::micro>(latency).count();
+				if (longLatency == 0) shortLatency = longLatency = us;
+				shortLatency += (us - shortLatency) * 0.2;
+				longLatency += (us - longLatency) * 0.01;
+				adjust(now);
+			}
+			wait = std::max(bytes.take(count, now), ops.take(1, now));
+		}
+		if (wait > std::chrono::nanoseconds::zero()) std::this_thread::sleep_for(wait);
+	}
+};
+
+/**
+ * @brief moves the process to the idle I/O class and the lowest CPU priority, threads started later inherit both
+ */
+inline bool setIdlePriority() {
+	bool io = syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == 0;
+	bool cpu = setpriority(PRIO_PROCESS, 0, 19) == 0;
+	return io && cpu;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <format>
+#include <queue>
+
+#include <FSTree.hpp>
+#include <calculators.hpp>
+#include <observe.hpp>
+
+/**
+ * @brief where the time hashing a single file went
+ */
+struct FileTiming {
+	std::filesystem::path	 path;
+	std::uintmax_t			 size = 0;
+	std::chrono::nanoseconds open{}, read{}, digest{};
+
+	std::chrono::nanoseconds total() const { return open + read + digest; }
+};
+
+struct HashResult {
+	std::string checksum;
+	FileTiming	timing;
+};
+
+/**
+ * @brief opens and hashes a file, measuring both
+ */
+inline HashResult hashFile(ChecksumCalculator &calc, const File &file) {
+	HashResult result;
+	auto	   start  = std::chrono::steady_clock::now();
+	auto	   stream = file.getStream();
+	result.timing	  = {file.path, file.size, std::chrono::steady_clock::now() - start};
+	result.checksum	  = calc.calculate(*stream);
+	result.timing.read	 = calc.readTime;
+	result.timing.digest = calc.digestTime;
+	return result;
+}
+
+/**
+ * @brief keeps the count slowest files seen
+ */
+class SlowFileReport : public Observer<FileTiming> {
+	struct Slower {
+		bool operator()(const FileTiming &a, const FileTiming &b) const { return a.total() > b.total(); }
+	};
+
+	std::size_t																count;
+	std::priority_queue<FileTiming, std::vector<FileTiming>, Slower> slowest;	  // fastest of them on top
+
+   public:
+	SlowFileReport(std::size_t count) : count(count) {}
+
+	void update(const FileTiming &timing) override {
+		if (count == 0) return;
+		if (slowest.size() < count) slowest.push(timing);
+		else if (Slower()(timing, slowest.top())) {
+			slowest.pop();
+			slowest.push(timing);
+		}
+	}
+
+	/**
+	 * @return the slowest files, slowest first
+	 */
+	std::vector<FileTiming> get() const {
+		auto					copy = slowest;
+		std::vector<FileTiming> result;
+		while (!copy.empty()) {
+			result.push_back(copy.top());
+			copy.pop();
+		}
+		std::ranges::reverse(result);
+		return result;
+	}
+
+	void print(std::ostream &os) const {
+		using ms = std::chrono::duration<double, std::milli>;
+		os << std::format("{:>12} {:>12} {:>12} {:>12} {:>14}  {}\n", "total (ms)", "open (ms)", "read (ms)",
+						  "digest (ms)", "size", "path");
+		for (const auto &t : get()) {
+			os << std::format("{:12.3f} {:12.3f} {:12.3f} {:12.3f} {:14}  {}\n", ms(t.total()).count(),
+							  ms(t.open).count(), ms(t.read).count(), ms(t.digest).count(), t.size, t.path.string());
+		}
+	}
+};
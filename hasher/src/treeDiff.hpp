@@ -0,0 +1,175 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <numeric>
+#include <optional>
+
+#include <FSTree.hpp>
+#include <calculators.hpp>
+#include <reportData.hpp>
+#include <visitors.hpp>
+
+/**
+ * @brief The entries of one tree of a comparison, handed over by top-level entry: a top-level file, or a top-level
+ * directory with everything below it. They come in the order of their names, as the merkle writer visits them.
+ */
+class TreeEntries {
+	std::mutex				m;
+	std::condition_variable changed;
+	std::deque<ReportData>	chunks;
+	bool					done = false;
+	std::string				root;	  // checksum of the whole tree once it is done
+
+   public:
+	void push(ReportData chunk) {
+		std::lock_guard lock(m);
+		chunks.push_back(std::move(chunk));
+		changed.notify_all();
+	}
+
+	/**
+	 * @param checksum of the root, empty when hashing failed
+	 */
+	void finish(const std::string &checksum) {
+		std::lock_guard lock(m);
+		root = checksum;
+		done = true;
+		changed.notify_all();
+	}
+
+	/**
+	 * @brief waits for the next top-level entry
+	 *
+	 * @return nothing once the tree is done
+	 */
+	std::optional<ReportData> next() {
+		std::unique_lock lock(m);
+		changed.wait(lock, [&] { return done || !chunks.empty(); });
+		if (chunks.empty()) return std::nullopt;
+		ReportData chunk = std::move(chunks.front());
+		chunks.pop_front();
+		return chunk;
+	}
+
+	/**
+	 * @brief checksum of the root, valid after next() returned nothing
+	 */
+	const std::string &checksum() const { return root; }
+};
+
+/**
+ * @brief merkle writer that passes every completed top-level entry to entries, with paths relative to the root
+ */
+class TreeEntriesWriter : public MerkleHashStreamWriter {
+	std::filesystem::path root;
+	TreeEntries			 &entries;
+	mutable ReportData	  chunk;
+	mutable std::string	  rootChecksum;
+
+   protected:
+	void writeEntry(const std::filesystem::path &path, const std::string &checksum, bool directory) const override {
+		auto relative = path.lexically_relative(root);
+		if (relative == ".") {
+			rootChecksum = checksum;
+			return;
+		}
+		chunk.push_back({relative, checksum, directory});
+		// a top-level entry comes after everything below it
+		if (std::next(relative.begin()) == relative.end()) {
+			entries.push(std::move(chunk));
+			chunk.clear();
+		}
+	}
+
+   public:
+	TreeEntriesWriter(ChecksumCalculator &calc, const std::filesystem::path &root, TreeEntries &entries)
+		: MerkleHashStreamWriter(calc, std::cerr), root(root), entries(entries) {}
+
+	/**
+	 * @brief hands over what is left and ends the tree, called after the visit
+	 */
+	void finish() {
+		if (!chunk.empty()) entries.push(std::move(chunk));
+		chunk.clear();
+		entries.finish(rootChecksum);
+	}
+};
+
+/**
+ * @brief Compares two directories without writing intermediate reports. Both trees are scanned and hashed
+ * concurrently, and every top-level entry is compared as soon as both trees are done with it, so differences are
+ * reported while the rest is still being hashed. Subtrees with equal checksums are reported once, and two equal trees
+ * as a single "./". Entries without differences are therefore held back until the first difference shows that the
+ * roots differ. finish() is left to the caller.
+ */
+inline void diffTrees(const std::function<std::unique_ptr<FSTreeBuilder>()> &makeBuilder,
+					  const std::filesystem::path &lhs, const std::filesystem::path &rhs, const std::string &algorithm,
+					  DiffReporter &report) {
+	TreeEntries lhsEntries, rhsEntries;
+	auto		hash = [&](const std::filesystem::path &path, TreeEntries &entries) {
+		   try {
+			   auto builder = makeBuilder();
+			   auto tree	= builder->build(path);
+			   if (!tree) throw std::runtime_error("failed to build tree: " + path.string());
+			   auto				 calculator = ChecksumCalculatorFactory::instance().create(algorithm);
+			   TreeEntriesWriter writer(*calculator, std::filesystem::relative(tree->path), entries);
+			   tree->accept(writer);
+			   writer.finish();
+		   } catch (...) {
+			   entries.finish("");
+			   throw;
+		   }
+	};
+	auto lhsDone = std::async(std::launch::async, hash, lhs, std::ref(lhsEntries));
+	auto rhsDone = std::async(std::launch::async, hash, rhs, std::ref(rhsEntries));
+
+	std::vector<std::unique_ptr<DiffRecorder>> held;	 // equal so far, reported only if the trees turn out to differ
+	bool									   differs = false;
+	auto									   emit	   = [&](ReportData old, ReportData current) {
+		   sortReportData(old);
+		   sortReportData(current);
+		   auto recorder = std::make_unique<DiffRecorder>(report);
+		   compare(old, current, *recorder);
+		   auto &counts = recorder->getCounts();
+		   if (!differs && counts[std::size_t(DiffStatus::Ok)] == std::reduce(counts.begin(), counts.end())) {
+			   held.push_back(std::move(recorder));
+			   return;
+		   }
+		   differs = true;
+		   for (const auto &equal : held)
+			   equal->replay(report);
+		   held.clear();
+		   recorder->replay(report);
+	};
+
+	auto l = lhsEntries.next(), r = rhsEntries.next();
+	while (l || r) {
+		if (r && (!l || r->back().path < l->back().path)) {
+			emit({}, std::move(*r));
+			r = rhsEntries.next();
+		} else if (l && (!r || l->back().path < r->back().path)) {
+			emit(std::move(*l), {});
+			l = lhsEntries.next();
+		} else {
+			emit(std::move(*l), std::move(*r));
+			l = lhsEntries.next();
+			r = rhsEntries.next();
+		}
+	}
+	lhsDone.get();
+	rhsDone.get();
+
+	if (!differs && lhsEntries.checksum() == rhsEntries.checksum()) {
+		std::uintmax_t files = 0;
+		for (const auto &equal : held)
+			files += equal->getCounts()[std::size_t(DiffStatus::Ok)];
+		report.add(DiffStatus::Ok, ".", true, files);
+	} else
+		for (const auto &equal : held)
+			equal->replay(report);
+}
@@ -5,8 +5,9 @@
 #include <cxxabi.h>
 #include <sstream>
 
+// inline: runs once per program, not once for every translation unit that includes the header
 #define JOB(name, ...)                     \
-	static int _job_##name = []() -> int { \
+	inline int _job_##name = []() -> int { \
 		__VA_ARGS__;                       \
 		return 0;                          \
 	}();
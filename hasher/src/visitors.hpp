@@ -3,6 +3,7 @@
 #include <calculators.hpp>
 #include <observe.hpp>
 #include <reportData.hpp>
+#include <scheduler.hpp>
 #include "nlohmann/json.hpp"
 
 class FileVisitor : public FSVisitor {
@@ -91,25 +92,49 @@ class TreeWriter : public ReportWriter {
 
 class HashStreamWriter : public ReportWriter,
 						 public ForwardObservable<std::uintmax_t>,
-						 public BasicObservable<std::filesystem::path> {
+						 public ProgressObservable<std::filesystem::path>,
+						 public BasicObservable<FileTiming> {
    protected:
 	ChecksumCalculator &calc;
+	HashScheduler	   *scheduler = nullptr;
 
    public:
 	std::string calculateHash(const File &node) const {
-		BasicObservable<std::filesystem::path>::notifyObservers(node.path);
-		return calc.calculate(*node.getStream());
+		ProgressObservable<std::filesystem::path>::notifyObservers(node.path);
+		HashResult result;
+		if (scheduler) {
+			result = scheduler->take(node);
+			ForwardObservable<std::uintmax_t>::notifyObservers(node.size);
+		} else result = hashFile(calc, node);
+		BasicObservable<FileTiming>::notifyObservers(result.timing);
+		return std::move(result.checksum);
 	}
 	HashStreamWriter(ChecksumCalculator &calc, std::ostream &os)
 		: ReportWriter(os), ForwardObservable<std::uintmax_t>(&calc), calc(calc) {}
+
+	/**
+	 * @brief take checksums from scheduler instead of calculating them while visiting
+	 */
+	void setScheduler(HashScheduler *scheduler) { this->scheduler = scheduler; }
+
+	/**
+	 * @brief writes the entry of a file, relative is its path in the report
+	 */
+	virtual void writeFile(const File &node, const std::filesystem::path &relative, const std::string &checksum) const {}
+
+	using ReportWriter::visit;
+	void visit(const File &node) const override {
+		std::string checksum = calculateHash(node);
+		writeFile(node, getRelativePath(node), checksum);
+	}
 };
 
 class GNUHashStreamWriter : public HashStreamWriter {
    public:
 	using HashStreamWriter::HashStreamWriter;
 
-	void visit(const File &node) const override {
-		os << calculateHash(node) << " *" << getRelativePath(node).string() << std::endl;
+	void writeFile(const File &, const std::filesystem::path &relative, const std::string &checksum) const override {
+		os << checksum << " *" << relative.string() << std::endl;
 	}
 };
 
@@ -122,11 +147,9 @@ class JSONHashStreamWriter : public HashStreamWriter {
 
 	~JSONHashStreamWriter() { os << j; }
 
-	void visit(const File &node) const override {
-		j.emplace_back(nlohmann::json{{"mode", "binary"},
-									  {"checksum", calculateHash(node)},
-									  {"path", getRelativePath(node).string()},
-									  {"size", node.size}});
+	void writeFile(const File &node, const std::filesystem::path &relative, const std::string &checksum) const override {
+		j.emplace_back(nlohmann::json{
+			{"mode", "binary"}, {"checksum", checksum}, {"path", relative.string()}, {"size", node.size}});
 	}
 };
 
@@ -137,17 +160,76 @@ class ReportDataHashStreamWriter : public HashStreamWriter {
 	ReportDataHashStreamWriter(ChecksumCalculator &calc, std::ostream &os, ReportData &data)
 		: HashStreamWriter(calc, os), data(data) {}
 
-	void visit(const File &node) const override {
-		std::string hash = calculateHash(node);
-		data.push_back({getRelativePath(node), hash});
+	void writeFile(const File &, const std::filesystem::path &relative, const std::string &checksum) const override {
+		data.push_back({relative, checksum});
 	}
 
 	auto getData() { return data; }
 };
 
+/**
+ * @brief Writes a checksum for every file and for every directory. A directory's checksum is calculated from the
+ * "checksum *name" lines of its children sorted by name, so two trees are equal iff their root checksums are.
+ * Directory lines are written after their contents and end with a '/'.
+ */
+class MerkleHashStreamWriter : public HashStreamWriter {
+	mutable std::vector<std::string> listings;	   // listings of the directories currently being visited
+
+	void addToListing(const std::string &checksum, const std::string &name) const {
+		if (!listings.empty()) listings.back() += checksum + " *" + name + '\n';
+	}
+
+   protected:
+	virtual void writeEntry(const std::filesystem::path &path, const std::string &checksum, bool directory) const {
+		os << checksum << " *" << path.string() << (directory ? "/" : "") << '\n';
+	}
+
+   public:
+	using HashStreamWriter::HashStreamWriter;
+
+	void visit(const File &node) const override {
+		std::string checksum = calculateHash(node);
+		writeEntry(getRelativePath(node), checksum, false);
+		addToListing(checksum, node.path.filename().string());
+	}
+
+	void visitDir(const Directory &node) const override {
+		std::vector<const FSNode *> children;
+		for (auto &child : node.children)
+			children.push_back(child.get());
+		std::ranges::sort(children, {}, [](const FSNode *n) { return n->path.filename(); });
+
+		listings.emplace_back();
+		for (auto child : children)
+			child->accept(*this);
+		std::istringstream listing(std::move(listings.back()));
+		listings.pop_back();
+
+		calc.setMuted(true);	 // listings are not part of the progress
+		std::string checksum = calc.calculate(listing);
+		calc.setMuted(false);
+		writeEntry(path, checksum, true);
+		addToListing(checksum, node.path.filename().string() + '/');
+	}
+};
+
+class ReportDataMerkleHashStreamWriter : public MerkleHashStreamWriter {
+	ReportData &data;
+
+   protected:
+	void writeEntry(const std::filesystem::path &path, const std::string &checksum, bool directory) const override {
+		data.push_back({path, checksum, directory});
+	}
+
+   public:
+	ReportDataMerkleHashStreamWriter(ChecksumCalculator &calc, std::ostream &os, ReportData &data)
+		: MerkleHashStreamWriter(calc, os), data(data) {}
+};
+
 using HashStreamWriterFactory = Factory<HashStreamWriter, ChecksumCalculator &, std::ostream &>;
 
 JOB(hash_stream_writer_factory_register, {
 	HashStreamWriterFactory::instance().registerType<GNUHashStreamWriter>("gnu");
 	HashStreamWriterFactory::instance().registerType<JSONHashStreamWriter>("json");
+	HashStreamWriterFactory::instance().registerType<MerkleHashStreamWriter>("merkle");
 });
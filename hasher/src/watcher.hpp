@@ -0,0 +1,224 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+
+#include <observe.hpp>
+
+#include <fcntl.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+/**
+ * @brief a change below a watched root, paths are the root as given joined with the path relative to it
+ */
+struct WatchEvent {
+	enum class Kind {
+		Changed,	 // created, written to or moved in
+		Removed,	 // deleted or moved away
+		Overflow,	 // events were lost, everything may have changed
+	};
+
+	Kind				  kind;
+	std::filesystem::path path;
+	bool				  directory = false;
+};
+
+/**
+ * @brief Reports changes to a tree to its observers. fd() becomes readable when there are events, process() reads
+ * them and notifies the observers.
+ */
+class Watcher : public BasicObservable<WatchEvent> {
+   public:
+	virtual int	 fd() const = 0;
+	virtual void process()	= 0;
+	/**
+	 * @brief starts watching a directory, needed for every directory of the tree unless the backend watches whole
+	 * file systems
+	 */
+	virtual void watch(const std::filesystem::path &directory) = 0;
+	virtual ~Watcher() = default;
+};
+
+/**
+ * @brief inotify needs a watch on every directory, the number of watches is limited by fs.inotify.max_user_watches
+ */
+class InotifyWatcher : public Watcher {
+	static constexpr uint32_t mask = IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+									 IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+	int											   inotify;
+	std::unordered_map<int, std::filesystem::path> directories;
+
+   public:
+	InotifyWatcher() : inotify(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {
+		if (inotify == -1) throw std::runtime_error(std::string("inotify_init1 failed: ") + strerror(errno));
+	}
+	InotifyWatcher(const InotifyWatcher &)			  = delete;
+	InotifyWatcher &operator=(const InotifyWatcher &) = delete;
+	~InotifyWatcher() override { close(inotify); }
+
+	int fd() const override { return inotify; }
+
+	void watch(const std::filesystem::path &directory) override {
+		int wd = inotify_add_watch(inotify, directory.c_str(), mask);
+		if (wd != -1) {
+			directories[wd] = directory;
+			return;
+		}
+		if (errno == ENOENT || errno == ENOTDIR) return;	 // already gone, its removal is reported by the parent
+		if (errno == ENOSPC)
+			throw std::runtime_error("out of inotify watches, raise fs.inotify.max_user_watches");
+		throw std::runtime_error("failed to watch " + directory.string() + ": " + strerror(errno));
+	}
+
+	void process() override {
+		alignas(inotify_event) char buffer[1 << 16];
+		while (true) {
+			ssize_t length = read(inotify, buffer, sizeof(buffer));
+			if (length == -1) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return;
+				throw std::runtime_error(std::string("reading inotify events failed: ") + strerror(errno));
+			}
+			for (char *p = buffer; p < buffer + length;) {
+				auto *event = reinterpret_cast<inotify_event *>(p);
+				p += sizeof(inotify_event) + event->len;
+
+				if (event->mask & IN_Q_OVERFLOW) {
+					notifyObservers(WatchEvent{WatchEvent::Kind::Overflow, {}});
+					continue;
+				}
+				auto it = directories.find(event->wd);
+				if (it == directories.end()) continue;
+				if (event->mask & IN_IGNORED) {
+					directories.erase(it);
+					continue;
+				}
+				if (event->len == 0) continue;	   // events on the directory itself are reported by its parent
+
+				auto kind = event->mask & (IN_DELETE | IN_MOVED_FROM) ? WatchEvent::Kind::Removed
+																	   : WatchEvent::Kind::Changed;
+				notifyObservers(WatchEvent{kind, it->second / event->name, bool(event->mask & IN_ISDIR)});
+			}
+		}
+	}
+};
+
+/**
+ * @brief fanotify watches the whole file system of the root with a single mark, so there is no limit on the number of
+ * directories. Events carry the handle of the directory and the name of the entry, handles are resolved to paths with
+ * open_by_handle_at, which needs CAP_DAC_READ_SEARCH. Events outside of the root are dropped.
+ */
+class FanotifyWatcher : public Watcher {
+	static constexpr uint64_t mask =
+		FAN_CLOSE_WRITE | FAN_MODIFY | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR;
+
+	int					  fanotify;
+	int					  mountFd;
+	std::filesystem::path root, canonicalRoot;
+
+   public:
+	/**
+	 * @throws std::system_error when fanotify is not available, for example without CAP_SYS_ADMIN
+	 */
+	FanotifyWatcher(const std::filesystem::path &root)
+		: root(root), canonicalRoot(std::filesystem::canonical(root)) {
+		fanotify = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY);
+		if (fanotify == -1) throw std::system_error(errno, std::generic_category(), "fanotify_init");
+		mountFd = open(canonicalRoot.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (mountFd == -1 ||
+			fanotify_mark(fanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, canonicalRoot.c_str()) == -1) {
+			int error = errno;
+			if (mountFd != -1) close(mountFd);
+			close(fanotify);
+			throw std::system_error(error, std::generic_category(), "fanotify_mark");
+		}
+		if (!canResolve()) {
+			close(mountFd);
+			close(fanotify);
+			throw std::system_error(EPERM, std::generic_category(), "open_by_handle_at");
+		}
+	}
+	FanotifyWatcher(const FanotifyWatcher &)			= delete;
+	FanotifyWatcher &operator=(const FanotifyWatcher &) = delete;
+	~FanotifyWatcher() override {
+		close(mountFd);
+		close(fanotify);
+	}
+
+	int	 fd() const override { return fanotify; }
+	void watch(const std::filesystem::path &) override {}
+
+	void process() override {
+		alignas(fanotify_event_metadata) char buffer[1 << 16];
+		while (true) {
+			ssize_t length = read(fanotify, buffer, sizeof(buffer));
+			if (length == -1) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return;
+				throw std::runtime_error(std::string("reading fanotify events failed: ") + strerror(errno));
+			}
+			auto *event = reinterpret_cast<fanotify_event_metadata *>(buffer);
+			for (; FAN_EVENT_OK(event, length); event = FAN_EVENT_NEXT(event, length)) {
+				if (event->vers != FANOTIFY_METADATA_VERSION) throw std::runtime_error("unsupported fanotify version");
+				if (event->mask & FAN_Q_OVERFLOW) {
+					notifyObservers(WatchEvent{WatchEvent::Kind::Overflow, {}});
+					continue;
+				}
+				auto *info = reinterpret_cast<fanotify_event_info_fid *>(event + 1);
+				if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) continue;
+				auto *handle = reinterpret_cast<file_handle *>(info->handle);
+				auto  path	 = resolve(handle);
+				if (!path) continue;
+				*path /= reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes);
+
+				auto relative = path->lexically_relative(canonicalRoot);
+				if (relative.empty() || *relative.begin() == "..") continue;
+				auto kind = event->mask & (FAN_DELETE | FAN_MOVED_FROM) ? WatchEvent::Kind::Removed
+																		: WatchEvent::Kind::Changed;
+				notifyObservers(WatchEvent{kind, root / relative, bool(event->mask & FAN_ONDIR)});
+			}
+		}
+	}
+
+   private:
+	bool canResolve() const {
+		alignas(file_handle) char storage[sizeof(file_handle) + MAX_HANDLE_SZ];
+		auto					 *handle = reinterpret_cast<file_handle *>(storage);
+		int						  mountId;
+		handle->handle_bytes = MAX_HANDLE_SZ;
+		if (name_to_handle_at(mountFd, "", handle, &mountId, AT_EMPTY_PATH) == -1) return false;
+		return resolve(handle).has_value();
+	}
+
+	/**
+	 * @return the path of the directory with the handle, nothing when it no longer exists
+	 */
+	std::optional<std::filesystem::path> resolve(file_handle *handle) const {
+		int dir = open_by_handle_at(mountFd, handle, O_PATH | O_CLOEXEC);
+		if (dir == -1) return std::nullopt;
+		std::error_code ec;
+		auto path = std::filesystem::read_symlink("/proc/self/fd/" + std::to_string(dir), ec);
+		close(dir);
+		if (ec) return std::nullopt;
+		return path;
+	}
+};
+
+/**
+ * @brief fanotify where it is permitted, inotify otherwise
+ */
+inline std::unique_ptr<Watcher> makeWatcher(const std::filesystem::path &root) {
+	try {
+		return std::make_unique<FanotifyWatcher>(root);
+	} catch (const std::system_error &) { return std::make_unique<InotifyWatcher>(); }
+}
@@ -2,8 +2,14 @@
 #include <sstream>
 #include <FSTree.hpp>
 #include <calculators.hpp>
+#include <sha256mb.hpp>
 #include <visitors.hpp>
 #include <pipes.hpp>
+#include <treeDiff.hpp>
+#include <daemon.hpp>
+#include <shards.hpp>
+#include <compression.hpp>
+#include <progress.hpp>
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest.h>
@@ -44,12 +50,84 @@ TEST_CASE("SHA256") {
 	}
 }
 
+TEST_CASE("CRC32C") {
+	SUBCASE("check value") {
+		std::istringstream		 ss("123456789");
+		CRC32CChecksumCalculator calc;
+		CHECK_EQ(calc.calculate(ss), "e3069283");
+	}
+
+	SUBCASE("empty") {
+		std::istringstream		 ss("");
+		CRC32CChecksumCalculator calc;
+		CHECK_EQ(calc.calculate(ss), "00000000");
+	}
+
+	SUBCASE("hardware matches software") {
+		// the crc32 instruction is an illegal instruction on CPUs without SSE4.2
+		if (!CRC32CChecksumCalculator::hasHardwareSupport()) return;
+		std::string data;
+		for (int i = 0; i < 100003; i++)
+			data.push_back(char(i * 31 + 7));
+		CHECK_EQ(CRC32CChecksumCalculator::updateHardware(~0u, data.data(), data.size()),
+				 CRC32CChecksumCalculator::updateSoftware(~0u, data.data(), data.size()));
+	}
+}
+
+#ifdef HASHER_HAS_XXHASH
+TEST_CASE("XXH3_128") {
+	SUBCASE("empty") {
+		std::istringstream		   ss("");
+		XXH3_128ChecksumCalculator calc;
+		CHECK_EQ(calc.calculate(ss), "99aa06d3014798d86001c324468d497f");
+	}
+
+	SUBCASE("abc") {
+		std::istringstream		   ss("abc");
+		XXH3_128ChecksumCalculator calc;
+		CHECK_EQ(calc.calculate(ss), "06b05ab6733a618578af5f94892f3950");
+	}
+}
+#endif
+
+TEST_CASE("multi-buffer SHA256") {
+	SHA256ChecksumCalculator reference;
+	std::vector<std::string> messages;
+	for (std::size_t length = 0; length <= 200; length++) {
+		std::string message(length, '\0');
+		for (std::size_t i = 0; i < length; i++)
+			message[i] = char(i * 7 + length);
+		messages.push_back(message);
+	}
+	messages.push_back(std::string(100000, 'x'));
+	std::vector<std::string_view> views(messages.begin(), messages.end());
+
+	for (std::size_t lanes = 4; lanes <= SHA256MultiBuffer::lanes(); lanes *= 2) {
+		CAPTURE(lanes);
+		auto digests = SHA256MultiBuffer::hash(views, lanes);
+		REQUIRE_EQ(digests.size(), messages.size());
+		for (std::size_t i = 0; i < messages.size(); i++) {
+			CAPTURE(messages[i].size());
+			std::istringstream is(messages[i]);
+			CHECK_EQ(toHex(digests[i].data(), digests[i].size()), reference.calculate(is));
+		}
+	}
+
+	SHA256MultiBufferChecksumCalculator calc;
+	std::istringstream					is("abc");
+	CHECK_EQ(calc.calculate(is), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	CHECK_EQ(calc.calculate(std::vector<std::string_view>{"abc", ""}),
+			 std::vector<std::string>{"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+									  "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"});
+}
+
 TEST_CASE("Calculator Factory") {
 	std::istringstream		   ss("abc");
 	ChecksumCalculatorFactory &factory = ChecksumCalculatorFactory::instance();
 
 	CHECK_EQ(factory.exists("md5"), true);
 	CHECK_EQ(factory.exists("sha256"), true);
+	CHECK_EQ(factory.exists("crc32c"), true);
 
 	SUBCASE("md5") {
 		auto				calc = factory.create("md5");
@@ -62,6 +140,18 @@ TEST_CASE("Calculator Factory") {
 		ChecksumCalculator &c	 = *calc;
 		CHECK_EQ(typeid(c), typeid(SHA256ChecksumCalculator));
 	}
+
+	SUBCASE("unknown names") {
+		CHECK_THROWS_AS(factory.create("no-such-algorithm"), std::runtime_error);
+		CHECK_EQ(factory.exists("no-such-algorithm"), false);
+		CHECK_EQ(std::ranges::count(factory.getKeys(), "no-such-algorithm"), 0);
+	}
+
+	SUBCASE("sorted keys") {
+		auto keys = factory.getKeys();
+		CHECK(std::ranges::is_sorted(keys));
+		CHECK(std::ranges::adjacent_find(keys) == keys.end());
+	}
 }
 
 TEST_CASE("recursive iteration ls check") {
@@ -110,3 +200,1030 @@ TEST_CASE("md5 checksum directory") {
 	CHECK_EQ(getString(p.err()), "");
 	CHECK_EQ(getString(p.out()), oss.str());
 };
+
+TEST_CASE("merkle checksum directory") {
+	MD5ChecksumCalculator calc;
+	std::ostringstream	  oss;
+	MerkleHashStreamWriter writer(calc, oss);
+
+	auto res = FSTreeBuilderNoLinks().build(PROJECT_SOURCE_DIR "/test/asd");
+	CHECK(res);
+	res->accept(writer);
+
+	std::string dir = std::filesystem::relative(PROJECT_SOURCE_DIR "/test/asd").string();
+	std::istringstream listing("55a769e2a52987357f7533cf3c0b18c8 *1\n"
+							   "0d2a0b3284f1fa030d284b1ab403d950 *2\n"
+							   "4089b0c6b92157c99320857d4c459e7e *3\n");
+	std::string		   root = calc.calculate(listing);
+	CHECK_EQ(oss.str(), "55a769e2a52987357f7533cf3c0b18c8 *" + dir + "/1\n" +
+							"0d2a0b3284f1fa030d284b1ab403d950 *" + dir + "/2\n" +
+							"4089b0c6b92157c99320857d4c459e7e *" + dir + "/3\n" + root + " *" + dir + "/\n");
+
+	SUBCASE("read back and compare") {
+		std::istringstream is(oss.str());
+		ReportData		   oldData = MerkleReportDataBuilder().build(is);
+		CHECK_EQ(oldData.size(), 4);
+		CHECK(oldData.back().directory);
+		CHECK_EQ(oldData.back().path, dir);
+
+		ReportData newData = oldData;
+		sortReportData(oldData);
+		sortReportData(newData);
+		std::ostringstream result;
+		compare(oldData, newData, result);
+		CHECK_EQ(result.str(), "OK       \"" + dir + "/\"\n");
+
+		newData[1].checksum = "changed";
+		newData[0].checksum = "changed";
+		result.str("");
+		compare(oldData, newData, result);
+		CHECK_EQ(result.str(), "MODIFIED \"" + dir + "/1\"\n" + "OK       \"" + dir + "/2\"\n" + "OK       \"" + dir +
+								   "/3\"\n");
+	}
+}
+
+TEST_CASE("verify a subtree against the manifest of the whole tree") {
+	MD5ChecksumCalculator calc;
+	auto				  tree = FSTreeBuilderNoLinks().build(PROJECT_SOURCE_DIR "/test");
+	auto				  dir  = std::filesystem::relative(PROJECT_SOURCE_DIR "/test/asd");
+
+	std::ostringstream gnu, json, merkle;
+	tree->accept(GNUHashStreamWriter(calc, gnu));
+	{
+		JSONHashStreamWriter writer(calc, json);
+		tree->accept(writer);
+	}
+	tree->accept(MerkleHashStreamWriter(calc, merkle));
+
+	ReportData current;
+	FSTreeBuilderNoLinks().build(PROJECT_SOURCE_DIR "/test/asd")->accept(ReportDataHashStreamWriter(calc, std::cerr, current));
+	sortReportData(current);
+
+	auto expected = [&](bool directory) {
+		std::ostringstream oss;
+		if (directory) oss << "OK       " << (dir / "") << '\n';
+		else
+			for (auto file : {"1", "2", "3"})
+				oss << "OK       " << dir / file << '\n';
+		return oss.str();
+	};
+	for (auto [format, manifest] : {std::pair{"gnu", &gnu}, std::pair{"json", &json}, std::pair{"merkle", &merkle}}) {
+		CAPTURE(format);
+		auto builder = ReportDataBuilderFactory::instance().create(format);
+		builder->setSubtree(dir);
+		std::istringstream is(manifest->str());
+		ReportData		   old = builder->build(is);
+		for (const auto &item : old)
+			CHECK(isWithin(item.path, dir));
+		sortReportData(old);
+
+		ReportData newData = current;
+		if (std::string(format) == "merkle") {
+			// the directory line of the subtree is in both
+			auto directory = std::ranges::find_if(old, &FileData::directory);
+			REQUIRE(directory != old.end());
+			newData.push_back(*directory);
+			sortReportData(newData);
+		}
+		std::ostringstream result;
+		compare(old, newData, result);
+		CHECK_EQ(result.str(), expected(std::string(format) == "merkle"));
+	}
+}
+
+TEST_CASE("diff two trees") {
+	auto makeBuilder = []() -> std::unique_ptr<FSTreeBuilder> { return std::make_unique<FSTreeBuilderNoLinks>(); };
+	std::ostringstream oss;
+	LinesDiffReporter  report(oss);
+
+	SUBCASE("equal") {
+		diffTrees(makeBuilder, PROJECT_SOURCE_DIR "/test/asd", PROJECT_SOURCE_DIR "/test/asd", "md5", report);
+		CHECK_EQ(oss.str(), "OK       \"./\"\n");
+		CHECK_EQ(report.getCounts(), DiffReporter::Counts{3, 0, 0, 0});
+	}
+
+	SUBCASE("different") {
+		diffTrees(makeBuilder, PROJECT_SOURCE_DIR "/test/asd", PROJECT_SOURCE_DIR "/test/bbb", "md5", report);
+		CHECK_EQ(oss.str(), "DELETED  \"1\"\nDELETED  \"2\"\nDELETED  \"3\"\nNEW      \"bb\"\n");
+	}
+
+	SUBCASE("top-level entries compared one by one") {
+		auto root = std::filesystem::temp_directory_path() / "hasher_diff_test";
+		std::filesystem::remove_all(root);
+		for (auto side : {"lhs", "rhs"}) {
+			for (auto dir : {"a/x", "b", "e"})
+				std::filesystem::create_directories(root / side / dir);
+			std::ofstream(root / side / "a/x/1") << "same";
+			std::ofstream(root / side / "b/1") << "same";
+			std::ofstream(root / side / "b/2") << side;
+			std::ofstream(root / side / "top") << "same";
+		}
+		std::filesystem::create_directories(root / "lhs/c");
+		std::ofstream(root / "lhs/c/1") << "gone";
+		std::ofstream(root / "rhs/d") << "new";
+
+		diffTrees(makeBuilder, root / "lhs", root / "rhs", "md5", report);
+		CHECK_EQ(oss.str(), "OK       \"a/\"\nOK       \"b/1\"\nMODIFIED \"b/2\"\nDELETED  \"c/1\"\nNEW      \"d\"\n"
+							"OK       \"e/\"\nOK       \"top\"\n");
+		// a/ holds a file, e/ none
+		CHECK_EQ(report.getCounts(), DiffReporter::Counts{3, 1, 1, 1});
+		std::filesystem::remove_all(root);
+	}
+}
+
+TEST_CASE("diff reports") {
+	ReportData oldData = {{"a", "1"}, {"b", "2"}, {"c", "3"}, {"d\"", "4"}};
+	ReportData newData = {{"a", "1"}, {"b", "changed"}, {"d\"", "4"}, {"e", "5"}};
+	std::ostringstream oss;
+
+	SUBCASE("changes") {
+		ChangesDiffReporter report(oss);
+		compare(oldData, newData, report);
+		report.finish();
+		CHECK_EQ(oss.str(), "MODIFIED \"b\"\nDELETED  \"c\"\nNEW      \"e\"\n");
+		CHECK_EQ(report.getCounts(), DiffReporter::Counts{2, 1, 1, 1});
+	}
+
+	SUBCASE("summary") {
+		auto report = DiffReporterFactory::instance().create("summary", oss);
+		compare(oldData, newData, *report);
+		report->finish();
+		CHECK_EQ(oss.str(), "OK       2\nMODIFIED 1\nDELETED  1\nNEW      1\n");
+	}
+
+	SUBCASE("equal directories count their files") {
+		ReportData oldTree = {{"d", "x", true}, {"d/1", "1"}, {"d/e", "y", true}, {"d/e/2", "2"}, {"f", "3"}};
+		ReportData newTree = oldTree;
+		newTree.back().checksum = "changed";
+		auto report				= DiffReporterFactory::instance().create("summary", oss);
+		compare(oldTree, newTree, *report);
+		report->finish();
+		CHECK_EQ(oss.str(), "OK       2\nMODIFIED 1\nDELETED  0\nNEW      0\n");
+	}
+
+	SUBCASE("json") {
+		JSONDiffReporter report(oss);
+		compare(oldData, newData, report);
+		report.finish();
+		auto j = nlohmann::json::parse(oss.str());
+		CHECK_EQ(j["changes"], nlohmann::json::parse(R"([{"status": "modified", "path": "b"},
+														  {"status": "deleted", "path": "c"},
+														  {"status": "new", "path": "e"}])"));
+		CHECK_EQ(j["summary"], nlohmann::json::parse(R"({"ok": 2, "modified": 1, "deleted": 1, "new": 1})"));
+
+		oss.str("");
+		JSONDiffReporter same(oss);
+		compare(oldData, oldData, same);
+		same.finish();
+		CHECK_EQ(nlohmann::json::parse(oss.str())["changes"], nlohmann::json::array());
+	}
+
+	SUBCASE("json after hashing with progress") {
+		// like -c: the progress goes to stderr, stdout holds nothing but the report
+		auto					   tree = FSTreeBuilderNoLinks().build(PROJECT_SOURCE_DIR "/test/asd");
+		MD5ChecksumCalculator	   calc;
+		ReportData				   current;
+		ReportDataHashStreamWriter writer(calc, std::cerr, current);
+		std::ostringstream		   err;
+		auto					  *cout = std::cout.rdbuf(oss.rdbuf());
+		auto					  *cerr = std::cerr.rdbuf(err.rdbuf());
+		{
+			ProgressViewer progress(tree.get(), &writer, std::cerr);
+			tree->accept(writer);
+		}
+		sortReportData(current);
+		JSONDiffReporter report(std::cout);
+		compare(current, current, report);
+		report.finish();
+		std::cout.rdbuf(cout);
+		std::cerr.rdbuf(cerr);
+
+		CHECK_NE(err.str().find("Processing file"), std::string::npos);
+		auto j = nlohmann::json::parse(oss.str());
+		CHECK_EQ(j["summary"]["ok"], 3);
+	}
+
+	SUBCASE("recorded and replayed") {
+		ChangesDiffReporter report(oss);
+		DiffRecorder		recorder(report);
+		compare(oldData, newData, recorder);
+		CHECK_EQ(oss.str(), "");
+		recorder.replay(report);
+		report.finish();
+		CHECK_EQ(oss.str(), "MODIFIED \"b\"\nDELETED  \"c\"\nNEW      \"e\"\n");
+		CHECK_EQ(report.getCounts(), DiffReporter::Counts{2, 1, 1, 1});
+	}
+}
+
+TEST_CASE("scheduled hashing keeps traversal order") {
+	auto tree = FSTreeBuilderNoLinks().build(PROJECT_SOURCE_DIR "/test");
+	CHECK(tree);
+
+	MD5ChecksumCalculator calc;
+	std::ostringstream	  expected;
+	tree->accept(GNUHashStreamWriter(calc, expected));
+
+	for (const auto &name : SchedulingPolicyFactory::instance().getKeys()) {
+		CAPTURE(name);
+		auto			   policy = SchedulingPolicyFactory::instance().create(name);
+		HashScheduler	   scheduler(*tree, "md5", *policy, 3);
+		std::ostringstream oss;
+		GNUHashStreamWriter writer(calc, oss);
+		writer.setScheduler(&scheduler);
+		tree->accept(writer);
+		CHECK_EQ(oss.str(), expected.str());
+	}
+
+	SUBCASE("batches of small files") {
+		SHA256ChecksumCalculator sha256;
+		std::ostringstream		 expected256;
+		tree->accept(GNUHashStreamWriter(sha256, expected256));
+
+		auto policy = SchedulingPolicyFactory::instance().create("smallest-first");
+		// without workers the batches are hashed by the writer's thread
+		for (std::size_t workers : {0, 2}) {
+			CAPTURE(workers);
+			HashScheduler		scheduler(*tree, "sha256_mb", *policy, workers);
+			std::ostringstream	oss;
+			GNUHashStreamWriter writer(sha256, oss);
+			writer.setScheduler(&scheduler);
+			tree->accept(writer);
+			CHECK_EQ(oss.str(), expected256.str());
+		}
+	}
+
+	SUBCASE("full reorder buffer") {
+		// room for a single checksum, the writer's file has to be hashed out of the policy's order
+		auto			   policy = SchedulingPolicyFactory::instance().create("largest-first");
+		HashScheduler	   scheduler(*tree, "md5", *policy, 3, 1);
+		std::ostringstream oss;
+		GNUHashStreamWriter writer(calc, oss);
+		writer.setScheduler(&scheduler);
+		tree->accept(writer);
+		CHECK_EQ(oss.str(), expected.str());
+		CHECK_EQ(scheduler.bufferedBytes(), 0);
+	}
+
+	SUBCASE("workers placed on NUMA nodes") {
+		// two nodes that share the first CPU this process may use, so that pinning works on any machine
+		cpu_set_t allowed;
+		REQUIRE_EQ(sched_getaffinity(0, sizeof(allowed), &allowed), 0);
+		unsigned cpu = 0;
+		while (!CPU_ISSET(cpu, &allowed))
+			cpu++;
+		auto root = std::filesystem::temp_directory_path() / "hasher_numa_nodes";
+		for (auto node : {"node0", "node1"}) {
+			std::filesystem::create_directories(root / node);
+			std::ofstream(root / node / "cpulist") << cpu << '\n';
+		}
+		NumaTopology topology(root);
+		REQUIRE_EQ(topology.getNodes().size(), 2);
+
+		auto				policy = SchedulingPolicyFactory::instance().create("largest-first");
+		HashScheduler		scheduler(*tree, "md5", *policy, 3, 64 << 20, {}, &topology);
+		std::ostringstream	oss;
+		GNUHashStreamWriter writer(calc, oss);
+		writer.setScheduler(&scheduler);
+		tree->accept(writer);
+		CHECK_EQ(oss.str(), expected.str());
+		std::filesystem::remove_all(root);
+	}
+}
+
+TEST_CASE("numa topology") {
+	CHECK_EQ(parseCpuList("0-3,8,10-11\n"), std::vector<unsigned>{0, 1, 2, 3, 8, 10, 11});
+	CHECK(parseCpuList("").empty());
+
+	// a fake sysfs and procfs with two nodes and a disk behind a controller with three interrupts
+	auto root = std::filesystem::temp_directory_path() / "hasher_numa_test";
+	std::filesystem::remove_all(root);
+	auto sys		= root / "sys";
+	auto proc		= root / "proc";
+	auto controller = sys / "devices/pci0000:00/0000:00:02.0";
+	for (auto [node, cpus] : {std::pair{"node0", "0-1"}, std::pair{"node1", "2-3"}}) {
+		std::filesystem::create_directories(sys / "devices/system/node" / node);
+		std::ofstream(sys / "devices/system/node" / node / "cpulist") << cpus << '\n';
+	}
+	std::ofstream(sys / "devices/system/node/online") << "0-1\n";
+	std::filesystem::create_directories(controller / "virtio1/block/vda/vda1");
+	std::ofstream(controller / "numa_node") << "1\n";
+	std::filesystem::create_directories(sys / "dev/block");
+	std::filesystem::create_directory_symlink("../../devices/pci0000:00/0000:00:02.0/virtio1/block/vda/vda1",
+											  sys / "dev/block/254:1");
+	auto irqs = [&](std::vector<const char *> lists) {
+		std::filesystem::remove_all(controller / "msi_irqs");
+		std::filesystem::create_directories(controller / "msi_irqs");
+		for (std::size_t i = 0; i < lists.size(); i++) {
+			auto irq = std::to_string(30 + i);
+			std::ofstream(controller / "msi_irqs" / irq);
+			std::filesystem::create_directories(proc / "irq" / irq);
+			std::ofstream(proc / "irq" / irq / "effective_affinity_list") << lists[i] << '\n';
+		}
+	};
+
+	NumaTopology topology(sys / "devices/system/node", false);
+	REQUIRE_EQ(topology.getNodes().size(), 2);
+	CHECK_EQ(topology.getNodes()[1].cpus, std::vector<unsigned>{2, 3});
+	CHECK_EQ(topology.nodeOf(1), 0);
+	CHECK_EQ(topology.nodeOf(3), 1);
+	CHECK_EQ(topology.nodeOf(4), -1);
+
+	irqs({"0", "1", "3"});
+	CHECK_EQ(topology.deviceNode(makedev(254, 1), sys, proc), 0);	  // most interrupts are served by node 0
+	irqs({"0", "2"});
+	CHECK_EQ(topology.deviceNode(makedev(254, 1), sys, proc), 1);	  // spread out, the controller's node
+	irqs({});
+	CHECK_EQ(topology.deviceNode(makedev(254, 1), sys, proc), 1);
+	CHECK_EQ(topology.deviceNode(makedev(7, 0), sys, proc), -1);
+
+	std::filesystem::remove_all(root);
+}
+
+/**
+ * @brief counts how many files are hashed at the same time
+ */
+class ConcurrencyCalculator : public ChecksumCalculator {
+   public:
+	static inline std::atomic<int> active = 0, peak = 0;
+
+	std::string calculate(std::istream &is) override {
+		int now = ++active;
+		for (int old = peak; old < now && !peak.compare_exchange_weak(old, now);)
+			;
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		std::string content = getString(is);
+		--active;
+		return content;
+	}
+};
+
+TEST_CASE("per device limits") {
+	ChecksumCalculatorFactory::instance().registerType<ConcurrencyCalculator>("test-concurrency");
+	auto tree = FSTreeBuilderNoLinks().build(PROJECT_SOURCE_DIR "/test");
+	CHECK_NE(tree->device, 0);
+
+	// pretend the files in asd are on another device
+	std::function<void(FSNode &, dev_t)> setDevice = [&](FSNode &node, dev_t device) {
+		if (node.path.filename() == "asd") device = 1;
+		node.device = device;
+		if (auto dir = dynamic_cast<Directory *>(&node))
+			for (auto &child : dir->children)
+				setDevice(*child, device);
+	};
+	setDevice(*tree, 2);
+
+	ConcurrencyCalculator calc;
+	std::ostringstream	  expected;
+	tree->accept(GNUHashStreamWriter(calc, expected));
+
+	DepthFirstPolicy policy;
+	for (unsigned limit : {1, 2}) {
+		CAPTURE(limit);
+		DeviceLimits limits;
+		limits.set(1, limit);
+		limits.set(2, limit);
+		ConcurrencyCalculator::peak = 0;
+
+		HashScheduler		scheduler(*tree, "test-concurrency", policy, 8, 64 << 20, limits);
+		std::ostringstream	oss;
+		GNUHashStreamWriter writer(calc, oss);
+		writer.setScheduler(&scheduler);
+		tree->accept(writer);
+		CHECK_EQ(oss.str(), expected.str());
+		CHECK_LE(ConcurrencyCalculator::peak, 2 * limit);
+	}
+
+	SUBCASE("full reorder buffer") {
+		DeviceLimits limits;
+		limits.setDefault(1);
+		ConcurrencyCalculator::peak = 0;
+		HashScheduler		scheduler(*tree, "test-concurrency", policy, 8, 1, limits);
+		std::ostringstream	oss;
+		GNUHashStreamWriter writer(calc, oss);
+		writer.setScheduler(&scheduler);
+		tree->accept(writer);
+		CHECK_EQ(oss.str(), expected.str());
+		CHECK_LE(ConcurrencyCalculator::peak, 2);
+	}
+}
+
+TEST_CASE("observers") {
+	struct Sum : Observer<int> {
+		std::atomic<long> total = 0;
+		void			  update(const int &value) override { total += value; }
+	};
+
+	SUBCASE("notified from several threads while observers change") {
+		BasicObservable<int> observable;
+		Sum					 always, sometimes;
+		observable.addObserver(&always);
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; t++)
+			threads.emplace_back([&] {
+				for (int i = 0; i < 10000; i++)
+					observable.notifyObservers(1);
+			});
+		for (int i = 0; i < 1000; i++) {
+			observable.addObserver(&sometimes);
+			observable.removeObserver(&sometimes);
+		}
+		for (auto &thread : threads)
+			thread.join();
+		CHECK_EQ(always.total, 40000);
+		CHECK_LE(sometimes.total, 40000);
+	}
+
+	SUBCASE("queued delivery keeps the order") {
+		struct Record : Observer<int> {
+			std::vector<int> values;
+			void			 update(const int &value) override { values.push_back(value); }
+		} record;
+		{
+			BasicObservable<int> observable;
+			QueuedObserver<int>	 queued(record, 16);
+			observable.addObserver(&queued);
+			for (int i = 0; i < 1000; i++)
+				observable.notifyObservers(i);
+		}
+		REQUIRE_EQ(record.values.size(), 1000);
+		CHECK(std::ranges::is_sorted(record.values));
+	}
+
+	SUBCASE("progress drawn from the queue") {
+		auto				  tree = FSTreeBuilderNoLinks().build(PROJECT_SOURCE_DIR "/test");
+		MD5ChecksumCalculator calc;
+		std::ostringstream	  manifest, drawn;
+		GNUHashStreamWriter	  writer(calc, manifest);
+		executeHashStreamWriter(*tree, writer, drawn);
+		auto total = std::to_string(tree->size);
+		CHECK_NE(drawn.str().find("Total " + total + "/" + total + " byte(s)"), std::string::npos);
+	}
+}
+
+TEST_CASE("process") {
+	SUBCASE("large output on both pipes") {
+		// more than a pipe can hold on stdout and stderr, waiting without draining them would deadlock
+		ShellProcess p("head -c 1000000 /dev/zero; head -c 300000 /dev/zero >&2; exit 3");
+		CHECK_EQ(WEXITSTATUS(p.wait()), 3);
+		CHECK_EQ(getString(p.out()).size(), 1000000);
+		CHECK_EQ(getString(p.err()).size(), 300000);
+	}
+
+	SUBCASE("communicate") {
+		std::string input(200000, 'a');
+		Process		p("md5sum", "-b");
+		CHECK_EQ(p.communicate(input), 0);
+
+		std::istringstream ss(input);
+		CHECK_EQ(getString(p.out()), MD5ChecksumCalculator().calculate(ss) + " *-\n");
+	}
+
+	SUBCASE("timeouts") {
+		ShellProcess p("echo ready; sleep 5");
+		CHECK_EQ(p.readOut(std::chrono::milliseconds(2000)), "ready\n");
+		CHECK_EQ(p.readOut(), "");
+		CHECK_FALSE(p.waitFor(std::chrono::milliseconds(10)));
+		CHECK(p.running());
+	}	 // killed and reaped by the destructor
+
+	SUBCASE("timeout while the child keeps writing") {
+		Process p("yes");
+		auto	start = std::chrono::steady_clock::now();
+		CHECK_FALSE(p.waitFor(std::chrono::milliseconds(50)));
+		CHECK_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+		CHECK(p.running());
+		CHECK_FALSE(p.readOut().empty());
+	}
+}
+
+TEST_CASE("pipe tee and splice") {
+	std::string data;
+	for (int i = 0; i < 20000; i++)
+		data.push_back(char('a' + i % 26));
+
+	int source[2], copy[2];
+	REQUIRE_NE(pipe(source), -1);
+	REQUIRE_NE(pipe(copy), -1);
+	Pipe sourceIn(source[1]), sourceOut(source[0]), copyIn(copy[1]), copyOut(copy[0]);
+
+	REQUIRE_EQ(write(sourceIn, data.data(), data.size()), data.size());
+	sourceIn = Pipe();
+
+	SUBCASE("tee") {
+		PipeStream stream(sourceOut);
+		stream.tee(copyIn);
+		CHECK_EQ(getString(stream), data);
+
+		copyIn = Pipe();
+		PipeStream copied(copyOut);
+		CHECK_EQ(getString(copied), data);
+	}
+
+	SUBCASE("splice") {
+		CHECK_EQ(spliceAll(sourceOut, copyIn), data.size());
+		copyIn = Pipe();
+
+		// large reads go around the stream buffer
+		PipeStream	copied(copyOut);
+		std::string result(data.size(), '\0');
+		copied.read(result.data(), result.size());
+		CHECK_EQ(copied.gcount(), data.size());
+		CHECK_EQ(result, data);
+	}
+
+	SUBCASE("tee into a full pipe waits for room") {
+		setNonBlocking(copyIn);
+		std::size_t filled = 0;
+		for (char block[4096]; write(copyIn, block, sizeof(block)) > 0;)
+			filled += sizeof(block);
+
+		std::string	 result;
+		double		 cpu = 0;
+		std::thread	 reader([&] {
+			 PipeStream stream(sourceOut);
+			 stream.tee(copyIn);
+			 result = getString(stream);
+			 timespec time;
+			 clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+			 cpu = time.tv_sec + time.tv_nsec / 1e9;
+		 });
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		std::string copied(filled + data.size(), '\0');
+		for (std::size_t done = 0; done < copied.size();) {
+			ssize_t count = read(copyOut, copied.data() + done, copied.size() - done);
+			REQUIRE_GT(count, 0);
+			done += count;
+		}
+		reader.join();
+		CHECK_EQ(result, data);
+		CHECK_EQ(copied.substr(filled), data);
+		CHECK_LT(cpu, 0.1);	   // waited instead of retrying while the copy was full
+	}
+}
+
+TEST_CASE("tree from a file list") {
+	std::string dir = std::filesystem::relative(PROJECT_SOURCE_DIR "/test").string();
+	std::string list = dir + "/asd/2" + '\0' + dir + "/asd" + '\0' + "./" + dir + "/bbb/bb" + '\0' + dir + "/asd/1";
+	std::istringstream is(list);
+
+	auto tree = FSTreeListBuilder().build(is);
+	CHECK(tree);
+	CHECK_EQ(tree->size, 9 + 40);
+
+	MD5ChecksumCalculator calc;
+	std::ostringstream	  oss;
+	tree->accept(GNUHashStreamWriter(calc, oss));
+	CHECK_EQ(oss.str(), "55a769e2a52987357f7533cf3c0b18c8 *./" + dir + "/asd/1\n" +
+							"0d2a0b3284f1fa030d284b1ab403d950 *./" + dir + "/asd/2\n" +
+							"d41d8cd98f00b204e9800998ecf8427e *./" + dir + "/bbb/bb\n");
+}
+
+TEST_CASE("slowest files") {
+	SlowFileReport report(2);
+	for (int i = 1; i <= 5; i++)
+		report.update(FileTiming{std::to_string(i), 0, std::chrono::milliseconds(i * 7 % 5)});
+
+	auto slowest = report.get();
+	REQUIRE_EQ(slowest.size(), 2);
+	CHECK_EQ(slowest[0].path, "2");		// 14 % 5 = 4 ms
+	CHECK_EQ(slowest[1].path, "4");		// 28 % 5 = 3 ms
+
+	SUBCASE("from a writer") {
+		MD5ChecksumCalculator calc;
+		std::ostringstream	  oss;
+		GNUHashStreamWriter	  writer(calc, oss);
+		SlowFileReport		  all(100);
+		writer.BasicObservable<FileTiming>::addObserver(&all);
+		FSTreeBuilderNoLinks().build(PROJECT_SOURCE_DIR "/test/asd")->accept(writer);
+		CHECK_EQ(all.get().size(), 3);
+	}
+
+	SUBCASE("read and digest time of one calculation") {
+		SHA256ChecksumCalculator calc;
+		std::istringstream		 is(std::string(3 << 20, 'x'));
+		calc.calculate(is);
+		CHECK_GT(calc.readTime.count(), 0);
+		CHECK_GT(calc.digestTime.count(), 0);
+	}
+}
+
+TEST_CASE("token bucket") {
+	auto		start = TokenBucket::clock::now();
+	TokenBucket bucket(1000, 100, start);
+
+	CHECK_EQ(bucket.take(100, start), std::chrono::nanoseconds::zero());
+	CHECK_EQ(bucket.take(500, start), std::chrono::milliseconds(500));
+	// the debt is paid off after half a second, then tokens accumulate up to the burst size
+	CHECK_EQ(bucket.take(0, start + std::chrono::milliseconds(500)), std::chrono::nanoseconds::zero());
+	CHECK_EQ(bucket.take(100, start + std::chrono::seconds(10)), std::chrono::nanoseconds::zero());
+	CHECK_EQ(bucket.take(1, start + std::chrono::seconds(10)), std::chrono::milliseconds(1));
+
+	TokenBucket unlimited;
+	CHECK_EQ(unlimited.take(1e12), std::chrono::nanoseconds::zero());
+}
+
+TEST_CASE("block pool") {
+	// a thread of its own starts with an empty pool
+	std::thread([] {
+		auto &pool = BlockPool::local();
+		char *large = pool.take(1 << 20).get();
+		CHECK_EQ(pool.take(5000).get(), large);	  // the block went back to the pool and serves smaller files too
+		{
+			auto small = pool.take(4096), other = pool.take(8192);
+			CHECK_EQ(small.get(), large);
+			CHECK_NE(other.get(), large);
+		}
+		CHECK_EQ(pool.take(1 << 20).get(), large);
+	}).join();
+}
+
+TEST_CASE("cache modes") {
+	std::string path = PROJECT_SOURCE_DIR "/test.cpp";
+	std::string expected;
+	{
+		std::ifstream		  is(path, std::ios::binary);
+		SHA256ChecksumCalculator calc;
+		expected = calc.calculate(is);
+	}
+
+	for (CacheMode mode : {CacheMode::Normal, CacheMode::DontNeed, CacheMode::Direct}) {
+		CAPTURE(int(mode));
+		ReadOptions::instance().cache = mode;
+		SHA256ChecksumCalculator calc;
+		// a buffer smaller than the file, so that it is read in several blocks
+		CHECK_EQ(calc.calculate(*FileStream::open(path, 4096)), expected);
+	}
+	ReadOptions::instance().cache = CacheMode::Normal;
+}
+
+TEST_CASE("sparse files") {
+	auto path = std::filesystem::temp_directory_path() / "hasher_sparse_test";
+	{
+		std::ofstream(path, std::ios::binary | std::ios::trunc);
+		std::filesystem::resize_file(path, 10 << 20);
+		std::fstream fs(path, std::ios::binary | std::ios::in | std::ios::out);
+		fs.seekp(5 << 20);
+		fs << "data in the middle";
+	}
+	std::string content(10 << 20, '\0');
+	std::memcpy(content.data() + (5 << 20), "data in the middle", 18);
+	std::istringstream		 expected(content);
+	SHA256ChecksumCalculator calc;
+	std::string				 checksum = calc.calculate(expected);
+
+	auto stream = FileStream::open(path, 1 << 16);
+	CHECK(stream->setSparse());
+	CHECK_EQ(calc.calculate(*stream), checksum);
+
+	ReadOptions::instance().sparse = false;
+	CHECK_EQ(calc.calculate(*FileStream::open(path, 1 << 16)), checksum);
+	ReadOptions::instance().sparse = true;
+
+	SUBCASE("data up to an unaligned end with O_DIRECT") {
+		{
+			std::fstream fs(path, std::ios::binary | std::ios::in | std::ios::out | std::ios::ate);
+			fs << "tail";
+		}
+		content += "tail";
+		std::istringstream withTail(content);
+		checksum					  = calc.calculate(withTail);
+		ReadOptions::instance().cache = CacheMode::Direct;
+		CHECK_EQ(calc.calculate(*FileStream::open(path, 1 << 16)), checksum);
+		ReadOptions::instance().cache = CacheMode::Normal;
+	}
+
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("scan filters") {
+	auto root = std::filesystem::temp_directory_path() / "hasher_filter_test";
+	std::filesystem::remove_all(root);
+	for (auto dir : {"src", "src/node_modules/pkg", "build", "docs"})
+		std::filesystem::create_directories(root / dir);
+	for (auto [file, content] : std::initializer_list<std::pair<const char *, const char *>>{
+			 {"src/main.cpp", "int main() {}"},
+			 {"src/main.o", "object"},
+			 {"src/node_modules/pkg/index.js", "js"},
+			 {"build/out", "large output file"},
+			 {"docs/readme.md", "read me"},
+			 {"docs/.hidden", "x"},
+		 })
+		std::ofstream(root / file) << content;
+	std::ofstream(root / ".hasherignore") << "# build output\n/build/\n*.o\n";
+	std::ofstream(root / "docs/.hasherignore") << "*.md\n";
+
+	auto files = [&](const ScanFilter *filter) {
+		FSTreeBuilderNoLinks builder;
+		builder.setFilter(filter);
+		auto					  tree = builder.build(root);
+		std::vector<const File *> collected;
+		tree->accept(FileCollector(collected));
+		std::vector<std::string> result;
+		for (const File *file : collected)
+			result.push_back(file->path.lexically_relative(root).string());
+		std::sort(result.begin(), result.end());
+		return result;
+	};
+	using names = std::vector<std::string>;
+
+	CHECK_EQ(files(nullptr), names{"build/out", "docs/readme.md", "src/main.cpp", "src/main.o",
+								   "src/node_modules/pkg/index.js"});
+
+	FilterChain empty;
+	CHECK_EQ(files(&empty).size(), 8);
+
+	GlobFilter exclude({}, {"node_modules", "*.o"});
+	CHECK_EQ(files(&exclude), names{".hasherignore", "build/out", "docs/.hasherignore", "docs/.hidden",
+									"docs/readme.md", "src/main.cpp"});
+
+	GlobFilter include({"*.cpp", "docs/*"}, {});
+	CHECK_EQ(files(&include), names{"docs/.hasherignore", "docs/.hidden", "docs/readme.md", "src/main.cpp"});
+
+	FilterChain ignore;
+	ignore.add(std::make_unique<HiddenFilter>()).add(std::make_unique<IgnoreFileFilter>());
+	CHECK_EQ(files(&ignore), names{"src/main.cpp", "src/node_modules/pkg/index.js"});
+	// only the directories being scanned keep their rules, a later scan reads the ignore files again
+	std::ofstream(root / "docs/.hasherignore") << "!*.md\n";
+	CHECK_EQ(files(&ignore), names{"docs/readme.md", "src/main.cpp", "src/node_modules/pkg/index.js"});
+	std::ofstream(root / ".hasherignore") << "# build output\n/build/\n";
+	CHECK_EQ(files(&ignore), names{"docs/readme.md", "src/main.cpp", "src/main.o", "src/node_modules/pkg/index.js"});
+
+	SizeFilter size(3, 7);
+	CHECK_EQ(files(&size), names{"docs/.hasherignore", "docs/readme.md", "src/main.o"});
+
+	auto		now = std::chrono::system_clock::now();
+	MTimeFilter recent(now - std::chrono::hours(1));
+	CHECK_EQ(files(&recent).size(), 8);
+	MTimeFilter old(std::chrono::system_clock::time_point::min(), now - std::chrono::hours(1));
+	CHECK(files(&old).empty());
+
+	OneFileSystemFilter xdev;
+	CHECK_EQ(files(&xdev).size(), 8);
+
+	CHECK_EQ(parseTime("@86400"), std::chrono::system_clock::time_point(std::chrono::hours(24)));
+	CHECK_THROWS(parseTime("yesterday"));
+
+	std::filesystem::remove_all(root);
+}
+
+TEST_CASE("daemon") {
+	auto root = std::filesystem::temp_directory_path() / "hasher_daemon_test";
+	std::filesystem::remove_all(root);
+	std::filesystem::create_directories(root / "sub");
+	std::ofstream(root / "a") << "first";
+	std::ofstream(root / "sub/b") << "second";
+
+	SUBCASE("inotify") {
+		InotifyWatcher			watcher;
+		std::vector<WatchEvent> events;
+		struct Collect : Observer<WatchEvent> {
+			std::vector<WatchEvent> &events;
+			Collect(std::vector<WatchEvent> &events) : events(events) {}
+			void update(const WatchEvent &event) override { events.push_back(event); }
+		} collect(events);
+		watcher.addObserver(&collect);
+		watcher.watch(root);
+		watcher.watch(root / "sub");
+
+		std::ofstream(root / "sub/c") << "new";
+		std::filesystem::remove(root / "a");
+		watcher.process();
+		CHECK(std::ranges::any_of(events, [&](const WatchEvent &e) {
+			return e.kind == WatchEvent::Kind::Changed && e.path == root / "sub/c";
+		}));
+		CHECK(std::ranges::any_of(events, [&](const WatchEvent &e) {
+			return e.kind == WatchEvent::Kind::Removed && e.path == root / "a";
+		}));
+	}
+
+	SUBCASE("manifest follows changes") {
+		auto			   socket = std::filesystem::temp_directory_path() / "hasher_daemon_test.sock";
+		MD5ChecksumCalculator calc;
+		auto			   md5 = [&](const std::string &text) {
+			  std::istringstream is(text);
+			  return calc.calculate(is);
+		};
+		auto line = [&](const std::string &text, const std::string &path) {
+			return md5(text) + " *" + (std::filesystem::relative(root) / path).string() + "\n";
+		};
+
+		HashDaemon daemon(root, "md5", nullptr, std::chrono::milliseconds(20));
+		daemon.listen(socket);
+		std::thread thread([&] { daemon.run(); });
+
+		// waits until the daemon serves the expected manifest
+		auto expect = [&](const std::string &expected) {
+			std::string manifest;
+			for (int i = 0; i < 200 && manifest != expected; i++) {
+				if (i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				manifest = HashDaemon::query(socket);
+			}
+			CHECK_EQ(manifest, expected);
+		};
+		expect(line("first", "a") + line("second", "sub/b"));
+
+		std::ofstream(root / "a") << "changed";
+		std::filesystem::create_directories(root / "new/deeper");
+		std::ofstream(root / "new/deeper/c") << "third";
+		std::ofstream(root / ".hidden") << "skipped";
+		expect(line("changed", "a") + line("third", "new/deeper/c") + line("second", "sub/b"));
+
+		std::filesystem::rename(root / "sub", root / "moved");
+		std::filesystem::remove_all(root / "new");
+		expect(line("changed", "a") + line("second", "moved/b"));
+
+		daemon.stop();
+		thread.join();
+	}
+
+	std::filesystem::remove_all(root);
+}
+
+TEST_CASE("sharded manifest") {
+	auto root = std::filesystem::temp_directory_path() / "hasher_shard_test";
+	auto indexPath = std::filesystem::temp_directory_path() / "hasher_shard_test.manifest";
+	std::filesystem::remove_all(root);
+	for (auto dir : {"a", "b", "c/x"})
+		std::filesystem::create_directories(root / dir);
+	for (auto file : {"a/1", "a/2", "b/1", "c/x/1", "top"})
+		std::ofstream(root / file) << file;
+	auto relative = std::filesystem::relative(root);
+
+	auto lines = [](std::istream &is) {
+		std::vector<std::string> result;
+		for (std::string line; std::getline(is, line);)
+			result.push_back(line);
+		std::ranges::sort(result);
+		return result;
+	};
+	auto hash = [&](const std::filesystem::path &path) {
+		MD5ChecksumCalculator	   calc;
+		ReportData				   data;
+		ReportDataHashStreamWriter writer(calc, std::cerr, data);
+		FSTreeBuilderNoLinks().build(path)->accept(writer);
+		return data;
+	};
+
+	for (auto by : {ShardIndex::Key::Directory, ShardIndex::Key::Hash}) {
+		CAPTURE(int(by));
+		MD5ChecksumCalculator calc;
+		std::ostringstream	  plain;
+		{
+			auto tree = FSTreeBuilderNoLinks().build(root);
+			tree->accept(GNUHashStreamWriter(calc, plain));
+			ShardedHashStreamWriter writer(calc, std::cerr, indexPath, "gnu", 3, by);
+			tree->accept(writer);
+		}
+
+		std::ifstream is(indexPath);
+		REQUIRE(ShardIndex::isIndex(is));
+		ShardIndex index = ShardIndex::load(is);
+		CHECK_EQ(index.shards.size(), 3);
+		CHECK_EQ(index.root, relative);
+
+		// together the shards hold the whole manifest, every file in the shard it belongs to
+		std::string all;
+		for (std::size_t i = 0; i < index.shards.size(); i++) {
+			std::ifstream shard(indexPath.parent_path() / index.shards[i]);
+			for (const auto &item : GNUReportDataBuilder().build(shard)) {
+				CHECK_EQ(index.shardOf(item.path), i);
+				all += item.checksum + " *" + item.path.string() + "\n";
+			}
+		}
+		std::istringstream expected(plain.str()), actual(all);
+		CHECK_EQ(lines(actual), lines(expected));
+
+		std::ostringstream oss;
+		LinesDiffReporter  report(oss);
+		compareShards(index, indexPath, hash(root), relative, 2, report);
+		std::istringstream result(oss.str());
+		CHECK_EQ(lines(result).size(), 5);
+		CHECK_EQ(oss.str().find("OK "), 0);
+		CHECK_EQ(oss.str().find("MODIFIED"), std::string::npos);
+	}
+
+	// a subtree of a manifest sharded by directory is in a single shard
+	{
+		MD5ChecksumCalculator	calc;
+		ShardedHashStreamWriter writer(calc, std::cerr, indexPath, "gnu", 3, ShardIndex::Key::Directory);
+		FSTreeBuilderNoLinks().build(root)->accept(writer);
+	}
+	std::ofstream(root / "a/1") << "changed";
+	std::filesystem::remove(root / "b/1");
+	std::ofstream(root / "c/new") << "new";
+	auto line = [&](const char *status, const char *path) {
+		std::ostringstream oss;
+		oss << status << relative / path << '\n';
+		return oss.str();
+	};
+
+	std::ifstream is(indexPath);
+	ShardIndex	  index = ShardIndex::load(is);
+
+	std::ostringstream oss;
+	LinesDiffReporter  report(oss);
+	compareShards(index, indexPath, hash(root), relative, 1, report);
+	CHECK_NE(oss.str().find(line("MODIFIED ", "a/1")), std::string::npos);
+	CHECK_NE(oss.str().find(line("DELETED  ", "b/1")), std::string::npos);
+	CHECK_NE(oss.str().find(line("NEW      ", "c/new")), std::string::npos);
+
+	auto needed = index.shardsFor(relative / "a");
+	REQUIRE_EQ(needed.size(), 1);
+	for (std::size_t i = 0; i < index.shards.size(); i++)
+		if (i != needed[0]) std::filesystem::remove(indexPath.parent_path() / index.shards[i]);
+	oss.str("");
+	compareShards(index, indexPath, hash(root / "a"), relative / "a", 1, report);
+	CHECK_EQ(oss.str(), line("MODIFIED ", "a/1") + line("OK       ", "a/2"));
+
+	std::filesystem::remove_all(root);
+	for (std::size_t i = 0; i < index.shards.size(); i++)
+		std::filesystem::remove(indexPath.parent_path() / index.shards[i]);
+	std::filesystem::remove(indexPath);
+}
+
+#ifdef HASHER_HAS_ZSTD
+TEST_CASE("zstd manifests") {
+	auto path = std::filesystem::temp_directory_path() / "hasher_zstd_test.md5.zst";
+
+	SUBCASE("round trip") {
+		// several chunks, so that the compressor thread and the queue are used
+		std::string text;
+		for (int i = 0; text.size() < (1 << 20); i++)
+			text += std::to_string(i * 7919) + " *some/path/" + std::to_string(i) + "\n";
+		{
+			ManifestOStream os(path, true);
+			os << text << std::endl;
+			os.close();
+		}
+		CHECK_LT(std::filesystem::file_size(path), text.size() / 2);
+		std::ifstream raw(path, std::ios::binary);
+		char		  magic[4];
+		raw.read(magic, 4);
+		CHECK_EQ(std::memcmp(magic, ManifestIStream::zstdMagic, 4), 0);
+
+		ManifestIStream	   is(path);
+		std::ostringstream read;
+		read << is.rdbuf();
+		CHECK_EQ(read.str(), text + "\n");
+	}
+
+	SUBCASE("plain manifests are read as they are") {
+		std::ofstream(path) << "plain\n";
+		ManifestIStream is(path);
+		std::string		line;
+		CHECK(std::getline(is, line));
+		CHECK_EQ(line, "plain");
+	}
+
+	SUBCASE("a truncated frame is an error") {
+		{
+			ManifestOStream os(path, true);
+			for (int i = 0; i < 10000; i++)
+				os << i << '\n';
+			os.close();
+		}
+		std::filesystem::resize_file(path, std::filesystem::file_size(path) - 8);
+		ManifestIStream is(path);
+		std::string		line;
+		CHECK_THROWS_AS(while (std::getline(is, line)), std::runtime_error);
+	}
+
+	SUBCASE("verify against compressed shards") {
+		auto root	   = std::filesystem::temp_directory_path() / "hasher_zstd_test";
+		auto indexPath = std::filesystem::temp_directory_path() / "hasher_zstd_test.manifest";
+		std::filesystem::remove_all(root);
+		std::filesystem::create_directories(root / "a");
+		for (auto file : {"a/1", "top"})
+			std::ofstream(root / file) << file;
+		auto relative = std::filesystem::relative(root);
+
+		MD5ChecksumCalculator calc;
+		auto				  tree = FSTreeBuilderNoLinks().build(root);
+		{
+			ShardedHashStreamWriter writer(calc, std::cerr, indexPath, "json", 2, ShardIndex::Key::Hash, true);
+			tree->accept(writer);
+		}
+		std::ifstream is(indexPath);
+		ShardIndex	  index = ShardIndex::load(is);
+		CHECK_EQ(index.shards[0].extension(), ".zst");
+
+		ReportData				   current;
+		ReportDataHashStreamWriter writer(calc, std::cerr, current);
+		tree->accept(writer);
+		std::ostringstream oss;
+		LinesDiffReporter  report(oss);
+		compareShards(index, indexPath, std::move(current), relative, 2, report);
+		CHECK_EQ(oss.str().find("OK "), 0);
+		CHECK_EQ(oss.str().find("DELETED"), std::string::npos);
+		CHECK_EQ(oss.str().find("NEW"), std::string::npos);
+
+		std::filesystem::remove_all(root);
+		for (const auto &shard : index.shards)
+			std::filesystem::remove(indexPath.parent_path() / shard);
+		std::filesystem::remove(indexPath);
+	}
+
+	std::filesystem::remove(path);
+}
+#endif